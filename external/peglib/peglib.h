@@ -591,6 +591,14 @@ using TracerLeave = std::function<void(
     const char *name, const char *s, size_t n, const SemanticValues &vs,
     const Context &c, const std::any &dt, size_t)>;
 
+/*
+ * Packrat statistics, per memoized rule
+ */
+struct PackratStats {
+  size_t lookups = 0; // Times the rule was tried
+  size_t hits = 0;    // Times the result was found in the table
+};
+
 class Context {
 public:
   const char *path;
@@ -626,19 +634,30 @@ public:
   std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
       cache_values;
 
+  // Memory used by the packrat tables, and the most they may use
+  const size_t packrat_limit;
+  size_t packrat_bytes = 0;
+  PackratStats *packrat_stats;
+
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
 
   Context(const char *a_path, const char *a_s, size_t a_l, size_t a_def_count,
           std::shared_ptr<Ope> a_whitespaceOpe, std::shared_ptr<Ope> a_wordOpe,
           bool a_enablePackratParsing, TracerEnter a_tracer_enter,
-          TracerLeave a_tracer_leave)
+          TracerLeave a_tracer_leave,
+          size_t a_packrat_limit = static_cast<size_t>(-1),
+          PackratStats *a_packrat_stats = nullptr)
       : path(a_path), s(a_s), l(a_l), whitespaceOpe(a_whitespaceOpe),
         wordOpe(a_wordOpe), def_count(a_def_count),
-        enablePackratParsing(a_enablePackratParsing),
+        enablePackratParsing(a_enablePackratParsing &&
+                             a_def_count * (a_l + 1) / 4 <= a_packrat_limit),
         cache_registered(enablePackratParsing ? def_count * (l + 1) : 0),
         cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
-        tracer_enter(a_tracer_enter), tracer_leave(a_tracer_leave) {
+        packrat_limit(a_packrat_limit),
+        packrat_bytes(enablePackratParsing ? def_count * (l + 1) / 4 : 0),
+        packrat_stats(a_packrat_stats), tracer_enter(a_tracer_enter),
+        tracer_leave(a_tracer_leave) {
 
     for (size_t pos = 0; pos < l; pos++) {
       if (s[pos] == '\n') { source_line_index.push_back(pos); }
@@ -667,7 +686,10 @@ public:
     auto col = a_s - s;
     auto idx = def_count * static_cast<size_t>(col) + def_id;
 
+    if (packrat_stats) { packrat_stats[def_id].lookups++; }
+
     if (cache_registered[idx]) {
+      if (packrat_stats) { packrat_stats[def_id].hits++; }
       if (cache_success[idx]) {
         auto key = std::pair(col, def_id);
         std::tie(len, val) = cache_values[key];
@@ -678,12 +700,17 @@ public:
       }
     } else {
       fn(val);
-      cache_registered[idx] = true;
-      cache_success[idx] = success(len);
       if (success(len)) {
+        // Past the memory limit, successful results are no longer kept
+        constexpr auto entry_size =
+            sizeof(decltype(cache_values)::value_type) + 4 * sizeof(void *);
+        if (packrat_bytes + entry_size > packrat_limit) { return; }
+        packrat_bytes += entry_size;
         auto key = std::pair(col, def_id);
         cache_values[key] = std::pair(len, val);
       }
+      cache_registered[idx] = true;
+      cache_success[idx] = success(len);
       return;
     }
   }
@@ -2065,6 +2092,13 @@ public:
   std::shared_ptr<Ope> whitespaceOpe;
   std::shared_ptr<Ope> wordOpe;
   bool enablePackratParsing = false;
+  // Index in the packrat tables, if this rule is memoized
+  size_t packrat_id = static_cast<size_t>(-1);
+  // Set on the start rule; number of memoized rules, memory limit and
+  // statistics for them
+  size_t packrat_count = 0;
+  size_t packrat_limit = static_cast<size_t>(-1);
+  mutable std::vector<PackratStats> packrat_stats;
   bool is_macro = false;
   std::vector<std::string> params;
   TracerEnter tracer_enter;
@@ -2095,8 +2129,9 @@ private:
     std::shared_ptr<Ope> ope = holder_;
     if (whitespaceOpe) { ope = std::make_shared<Sequence>(whitespaceOpe, ope); }
 
-    Context cxt(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
-                enablePackratParsing, tracer_enter, tracer_leave);
+    Context cxt(path, s, n, packrat_count, whitespaceOpe, wordOpe,
+                enablePackratParsing, tracer_enter, tracer_leave,
+                packrat_limit, packrat_stats.data());
 
     auto len = ope->parse(s, n, vs, cxt, dt);
     return Result{success(len), len, cxt.error_pos, cxt.message_pos,
@@ -2247,7 +2282,7 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
   size_t len;
   std::any val;
 
-  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
+  auto parse_rule = [&](std::any &a_val) {
     if (outer_->enter) { outer_->enter(s, n, dt); }
 
     auto se2 = scope_exit([&]() {
@@ -2283,7 +2318,13 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
         len = static_cast<size_t>(-1);
       }
     }
-  });
+  };
+
+  if (outer_->packrat_id == static_cast<size_t>(-1)) {
+    parse_rule(val);
+  } else {
+    c.packrat(s, outer_->packrat_id, len, val, parse_rule);
+  }
 
   if (success(len)) {
     if (!outer_->ignoreSemanticValue) {
@@ -3737,9 +3778,50 @@ public:
 
   void enable_packrat_parsing() {
     if (grammar_ != nullptr) {
+      std::vector<std::string> rules;
+      for (auto const &r : *grammar_) {
+        rules.push_back(r.first);
+      }
+      enable_packrat_parsing(rules);
+    }
+  }
+
+  // Memoize only the given rules, using at most `limit` bytes for the
+  // packrat tables of one parse
+  void enable_packrat_parsing(std::vector<std::string> const &rules,
+                              size_t limit = static_cast<size_t>(-1)) {
+    if (grammar_ != nullptr) {
+      for (auto &r : *grammar_) {
+        r.second.packrat_id = static_cast<size_t>(-1);
+      }
+      size_t count = 0;
+      for (auto const &name : rules) {
+        auto it = grammar_->find(name);
+        if (it != grammar_->end() &&
+            it->second.packrat_id == static_cast<size_t>(-1)) {
+          it->second.packrat_id = count++;
+        }
+      }
       auto &rule = (*grammar_)[start_];
-      rule.enablePackratParsing = true;
+      rule.enablePackratParsing = count > 0;
+      rule.packrat_count = count;
+      rule.packrat_limit = limit;
+      rule.packrat_stats.assign(count, {});
+    }
+  }
+
+  // Packrat statistics of all memoized rules, summed over all parses
+  std::vector<std::pair<std::string, PackratStats>> packrat_stats() const {
+    std::vector<std::pair<std::string, PackratStats>> result;
+    if (grammar_ != nullptr) {
+      auto const &stats = (*grammar_)[start_].packrat_stats;
+      for (auto const &r : *grammar_) {
+        if (r.second.packrat_id < stats.size()) {
+          result.emplace_back(r.first, stats[r.second.packrat_id]);
+        }
+      }
     }
+    return result;
   }
 
   template <typename T = Ast> parser &enable_ast() {
@@ -2,44 +2,49 @@
 
 #include "defines.h"
 
-#include <any>
 #include <cstdint>
 #include <vector>
 
-template <int A, typename ARG>
-ARG get_arg(std::vector<std::any> const& vec, std::false_type)
+// Arrays are held as `Buffer`s, so functions taking a vector get a copy
+template <int A, typename ARG, typename T = std::decay_t<ARG>>
+std::conditional_t<detail::Buffered<T>::value, T, ARG>
+get_arg(std::vector<Value> const& vec, std::false_type)
 {
-    static ARG empty{};
-    return A < vec.size() ? std::any_cast<ARG>(vec[A]) : empty;
+    if constexpr (detail::Buffered<T>::value) {
+        using E = typename T::value_type;
+        return A < vec.size() ? value_cast<Buffer<E>>(vec[A]).vector() : T{};
+    } else {
+        static T empty{};
+        return A < vec.size() ? value_cast<T>(vec[A]) : empty;
+    }
 }
 
 template <int A, typename ARG>
-ARG get_arg(std::vector<std::any> const& vec, std::true_type)
+ARG get_arg(std::vector<Value> const& vec, std::true_type)
 {
-    return static_cast<ARG>(A < vec.size() ? std::any_cast<double>(vec[A])
-                                           : 0.0);
+    return A < vec.size() ? number<ARG>(vec[A]) : ARG{};
 }
 
 template <int A, typename ARG>
-ARG get_arg(std::vector<std::any> const& vec)
+decltype(auto) get_arg(std::vector<Value> const& vec)
 {
     return get_arg<A, ARG>(vec, std::is_arithmetic<ARG>());
 }
 
 template <typename T>
-std::any make_res(T&& v, std::true_type)
+Value make_res(T&& v, std::true_type)
 {
-    return std::any(static_cast<double>(v));
+    return static_cast<Number>(v);
 }
 
 template <typename T>
-std::any make_res(T&& v, std::false_type)
+Value make_res(T&& v, std::false_type)
 {
-    return std::any(v);
+    return Value(std::forward<T>(v));
 }
 
 template <typename T>
-std::any make_res(T&& v)
+Value make_res(T&& v)
 {
     return make_res(std::forward<T>(v), std::is_arithmetic<T>());
 }
@@ -47,20 +52,20 @@ std::any make_res(T&& v)
 struct FunctionCaller
 {
     virtual ~FunctionCaller() = default;
-    virtual std::any call(std::vector<std::any> const&) const = 0;
+    virtual Value call(std::vector<Value> const&) const = 0;
 };
 
 template <typename... X>
 struct FunctionCallerImpl;
 
 template <class FX, class R>
-struct FunctionCallerImpl<FX, R (FX::*)(std::vector<std::any> const&) const>
+struct FunctionCallerImpl<FX, R (FX::*)(std::vector<Value> const&) const>
     : public FunctionCaller
 {
     explicit FunctionCallerImpl(FX const& f) : fn(f) {}
     FX fn;
 
-    std::any call(std::vector<std::any> const& args) const override
+    Value call(std::vector<Value> const& args) const override
     {
         return make_res(fn(args));
     }
@@ -73,25 +78,25 @@ struct FunctionCallerImpl<FX, R (FX::*)(ARGS...) const> : public FunctionCaller
     FX fn;
 
     template <size_t... A>
-    std::any apply(std::vector<std::any> const& vec,
+    Value apply(std::vector<Value> const& vec,
                    std::index_sequence<A...>) const
     {
         return make_res(fn(get_arg<A, ARGS>(vec)...));
     }
 
-    std::any call(std::vector<std::any> const& args) const override
+    Value call(std::vector<Value> const& args) const override
     {
         return apply(args, std::make_index_sequence<sizeof...(ARGS)>());
     }
 };
 
 // An `AnyCallable` holds a type erased function that can be called
-// with an array of std::any, and that will extract the real types
+// with an array of values, and that will extract the real types
 // and call the stored function.
 struct AnyCallable
 {
     std::unique_ptr<FunctionCaller> fc;
-    std::any operator()(std::vector<std::any> const& args) const
+    Value operator()(std::vector<Value> const& args) const
     {
         return fc->call(args);
     }
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator. Objects are placed back to back in large blocks, and are
+// all destroyed and freed together by `clear()`. Objects can not be freed
+// individually.
+class Arena
+{
+public:
+    explicit Arena(size_t blockSize_ = 256 * 1024) : blockSize(blockSize_) {}
+    ~Arena() { clear(); }
+
+    Arena(Arena const&) = delete;
+    Arena& operator=(Arena const&) = delete;
+
+    void* allocate(size_t size, size_t align)
+    {
+        auto p = (top + align - 1) & ~(align - 1);
+        if (p + size > end) {
+            newBlock(size + align);
+            p = (top + align - 1) & ~(align - 1);
+        }
+        top = p + size;
+        used += size;
+        return reinterpret_cast<void*>(p); // NOLINT
+    }
+
+    template <typename T, typename... ARGS>
+    T* make(ARGS&&... args)
+    {
+        auto* p = new (allocate(sizeof(T), alignof(T)))
+            T(std::forward<ARGS>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            destructors.push_back({&destroy<T>, p, 1});
+        }
+        return p;
+    }
+
+    // Allocate `n` default constructed objects
+    template <typename T>
+    T* make_array(size_t n)
+    {
+        if (n == 0) {
+            return nullptr;
+        }
+        auto* p = static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+        std::uninitialized_value_construct_n(p, n);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            destructors.push_back({&destroy<T>, p, n});
+        }
+        return p;
+    }
+
+    // Destroy all objects and free all memory
+    void clear()
+    {
+        std::for_each(destructors.rbegin(), destructors.rend(),
+                      [](Destructor const& d) { d.fn(d.ptr, d.count); });
+        destructors.clear();
+        blocks.clear();
+        top = end = 0;
+        used = reserved = 0;
+    }
+
+    // Number of bytes handed out
+    size_t size() const { return used; }
+    // Number of bytes allocated from the system
+    size_t capacity() const { return reserved; }
+
+private:
+    template <typename T>
+    static void destroy(void* p, size_t n)
+    {
+        std::destroy_n(static_cast<T*>(p), n);
+    }
+
+    void newBlock(size_t minSize)
+    {
+        auto sz = std::max(blockSize, minSize);
+        blocks.emplace_back(new uint8_t[sz]); // NOLINT
+        top = reinterpret_cast<uintptr_t>(blocks.back().get());
+        end = top + sz;
+        reserved += sz;
+    }
+
+    struct Destructor
+    {
+        void (*fn)(void*, size_t);
+        void* ptr;
+        size_t count;
+    };
+
+    size_t blockSize;
+    std::vector<std::unique_ptr<uint8_t[]>> blocks; // NOLINT
+    std::vector<Destructor> destructors;
+    uintptr_t top = 0;
+    uintptr_t end = 0;
+    size_t used = 0;
+    size_t reserved = 0;
+};
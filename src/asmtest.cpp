@@ -7,25 +7,29 @@
 #include <coreutils/crc.h>
 
 #include "machine.h"
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <fmt/color.h>
 #include <fmt/format.h>
 #include <string>
 
+extern char const* const grammar6502;
+
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
 void printSymbols(Assembler& ass)
 {
-    using std::any_cast;
-    ass.getSymbols().forAll([](std::string const& name, std::any const& val) {
-        if (auto const* n = any_cast<Number>(&val)) {
+    ass.getSymbols().forAll([](std::string const& name, Value const& val) {
+        if (auto n = value_cast<Number>(&val)) {
             fmt::print("{} == 0x{:x}\n", name, static_cast<int>(*n));
-        } else if (auto const* v = any_cast<std::vector<uint8_t>>(&val)) {
+        } else if (auto const* v = value_cast<Bytes>(&val)) {
             fmt::print("{} == [{} bytes]\n", name, v->size());
-        } else if (auto const* s = any_cast<std::string>(&val)) {
+        } else if (auto const* s = value_cast<std::string_view>(&val)) {
             fmt::print("{} == \"{}\"\n", name, *s);
         } else {
-            fmt::print("{} == ?{}\n", name, val.type().name());
+            fmt::print("{} == ?{}\n", name, val.type_name());
         }
     });
 }
@@ -96,7 +100,7 @@ TEST_CASE("png.layout")
     REQUIRE(image.colors[1] == 0xff'a80000);
     REQUIRE(image.colors[2] == 0xff'00ff00);
 
-    auto pixels = std::any_cast<std::vector<uint8_t>>(image.pixels);
+    auto pixels = image.pixels;
     auto tiles = layoutTiles(pixels, 32, 8, 8, 0);
 
     LOGI("TILES %d", tiles.size());
@@ -137,10 +141,12 @@ TEST_CASE("png.layout")
 TEST_CASE("any_callable")
 {
     AnyCallable fn;
-    fn = [](std::string s) -> long { return std::stol(s) + 3; };
+    fn = [](std::string_view s) -> long {
+        return std::stol(std::string(s)) + 3;
+    };
 
-    auto res = fn({std::any("100"s)});
-    REQUIRE(std::any_cast<double>(res) == 103);
+    auto res = fn({Value("100"sv)});
+    REQUIRE(value_cast<double>(res) == 103);
 }
 
 TEST_CASE("png")
@@ -265,7 +271,6 @@ print:
 
 TEST_CASE("assembler.sine_table")
 {
-    using std::any_cast;
     Assembler ass;
     // logging::setLevel(logging::Level::Debug);
     ass.parse(R"(
@@ -344,3 +349,492 @@ TEST_CASE("assembler.functions")
     REQUIRE(ass.getMachine().getSection("main").data[1] == 0xf);
     REQUIRE(ass.getMachine().getSection("main").data[3] == 66);
 }
+
+TEST_CASE("assembler.incremental")
+{
+    Assembler ass;
+    ass.useIncremental(true);
+    auto& syms = ass.getSymbols();
+    auto& mach = ass.getMachine();
+
+    ass.parse(R"(
+    !section "main", $800
+start:
+    lda #1
+    !if 1
+    {
+        ldx #2
+    }
+    rts
+end:
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(syms.get<Number>("end") == 0x805);
+
+    // Only the edited statement needs to be parsed again
+    ass.clear();
+    ass.parse(R"(
+    !section "main", $800
+start:
+    lda #1
+    !if 1
+    {
+        ldx #2
+    }
+    nop
+    rts
+end:
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(syms.get<Number>("end") == 0x806);
+    REQUIRE(mach.getSection("main").data[4] == 0xea);
+
+    // Errors are reported at their line in the whole source
+    ass.clear();
+    ass.parse(R"(
+    !section "main", $800
+start:
+    lda #1
+    ldx ##2
+    rts
+)");
+    REQUIRE(ass.getErrors().size() == 1);
+    REQUIRE(ass.getErrors()[0].line == 5);
+}
+
+TEST_CASE("assembler.profile")
+{
+    Assembler ass;
+    ass.useCache(false);
+    ass.profileGrammar();
+
+    ass.parse(R"(
+    !section "main", $800
+start:
+    lda #1
+loop:
+    jmp loop
+)");
+    REQUIRE(ass.getErrors().empty());
+
+    auto profile = ass.grammarProfile();
+    auto it = std::find_if(profile.begin(), profile.end(),
+                           [](auto const& r) { return r.rule == "Label"; });
+    REQUIRE(it != profile.end());
+    REQUIRE(it->successes == 2);
+    REQUIRE(it->attempts == it->successes + it->backtracks);
+    REQUIRE(it->evaluations >= 2);
+}
+
+TEST_CASE("assembler.fold")
+{
+    Assembler ass;
+    auto& syms = ass.getSymbols();
+
+    // Constant expressions are kept between passes, but not when they
+    // depend on a redefined constant or failed in an earlier pass
+    ass.parse(R"(
+    !section "main", $800
+    jmp end
+    a = round(sin(Math.Pi / 2) * 100) + 7 \ 2
+    b = Math.Pi * 10
+Math.Pi = 3
+end:
+    rts
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(syms.get<Number>("a") == 103);
+    REQUIRE(syms.get<Number>("b") == 30);
+
+    Assembler ass2;
+    ass2.parse(R"(
+    !section "main", $800
+    jmp end
+    !byte 1 / 0
+end:
+    rts
+)");
+    REQUIRE(ass2.getErrors().size() == 1);
+
+    // Neither are memoized results of a pure lambda
+    Assembler ass3;
+    ass3.parse(R"(
+    !section "main", $800
+    f = [ x -> 100 / x ]
+    !fill 3, f
+)");
+    REQUIRE(ass3.getErrors().size() == 1);
+
+    // translate() depends on the current encoding
+    Assembler ass4;
+    ass4.parse(R"(
+    !section "main", $800
+!macro text() {
+    !fill translate(bytes($41))
+}
+    !encoding "screencode_upper"
+    text()
+    !encoding "ascii"
+    text()
+)");
+    REQUIRE(ass4.getErrors().empty());
+    auto const& data = ass4.getMachine().getSection("main").data;
+    REQUIRE(data.size() == 2);
+    REQUIRE(data[0] == 1);
+    REQUIRE(data[1] == 0x41);
+
+    // A lambda argument hides a pure function of the same name
+    Assembler ass5;
+    ass5.parse(R"(
+    !section "main", $800
+    jmp end
+!macro m(sin) {
+    !byte sin(2)
+}
+    m([a -> a * 3])
+    m([a -> a * 5])
+end:
+)");
+    REQUIRE(ass5.getErrors().empty());
+    auto const& data5 = ass5.getMachine().getSection("main").data;
+    REQUIRE(data5.size() == 5);
+    REQUIRE(data5[3] == 6);
+    REQUIRE(data5[4] == 10);
+}
+
+TEST_CASE("assembler.memo")
+{
+    Assembler ass;
+    ass.useCache(false);
+    ass.profileGrammar();
+
+    // A pure lambda is evaluated once for the same arguments
+    ass.parse(R"(
+    !section "main", $800
+    f = [ x -> x * 7 + 1 ]
+    !byte f(3), f(3), f(3), f(3), f(3)
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(ass.getMachine().getSection("main").data[4] == 22);
+    auto profile = ass.grammarProfile();
+    auto it = std::find_if(profile.begin(), profile.end(),
+                           [](auto const& r) { return r.rule == "Variable"; });
+    REQUIRE(it != profile.end());
+    REQUIRE(it->evaluations == 1);
+}
+
+TEST_CASE("assembler.strings")
+{
+    Assembler ass;
+    auto& syms = ass.getSymbols();
+
+    // Created strings are stored once per assembly, and freed by clear()
+    ass.parse(R"(
+    !section "main", $800
+    s = str(12) + "ab"
+    t = to_upper(s)
+    !rept 10 { u = str(12) + "ab" }
+    rts
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(syms.get<std::string_view>("t") == "12AB");
+    REQUIRE(ass.getStrings().size() == 3);
+
+    auto const atoms = syms.atoms->size();
+    ass.clear();
+    REQUIRE(ass.getStrings().size() == 0);
+    REQUIRE(!syms.get_sym("s"));
+    REQUIRE(syms.atoms->size() < atoms);
+}
+
+TEST_CASE("assembler.clear")
+{
+    auto inc = fs::temp_directory_path() / "_clear_inc.asm";
+    {
+        utils::File f{inc.string(), utils::File::Mode::Write};
+        f.writeString("included:\n    nop\n");
+    }
+
+    // The last global label may live in an included file, which clear()
+    // frees, so it must not be used by the next assembly
+    Assembler ass;
+    ass.parse(fmt::format(R"(
+    !section "main", $800
+    !include "{}"
+    rts
+)",
+                          inc.string()));
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(ass.getLastLabel() == "included");
+
+    ass.clear();
+    REQUIRE(ass.getLastLabel().empty());
+    ass.parse(R"(
+    !section "main", $800
+.l: nop
+)");
+    REQUIRE(ass.getErrors().size() == 1);
+    REQUIRE(ass.getErrors()[0].message.find(
+                "Local label without global label") != std::string::npos);
+    fs::remove(inc);
+}
+
+TEST_CASE("assembler.call_sites")
+{
+    Assembler ass;
+
+    // Storing the same lambda again does not make calls look it up again
+    ass.parse(R"(
+    !section "main", $800
+    !rept 10 {
+        f = [ x -> x + 1 ]
+        !byte f(i)
+    }
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(ass.getMachine().getSection("main").data[9] == 10);
+    REQUIRE(ass.getResolvedCalls() == 1);
+}
+
+// A source big enough to be cached
+static std::string cachedSource(int lines)
+{
+    std::string source = "    !section \"main\", $800\n";
+    for (int i = 0; i < lines; i++) {
+        source += fmt::format("l{}: lda #{}\n    sta $d020\n", i, i & 0xff);
+    }
+    return source;
+}
+
+TEST_CASE("parser.cache")
+{
+    auto dir = fs::temp_directory_path() / "_bass_cache_test";
+    fs::remove_all(dir);
+    auto const source = cachedSource(300);
+
+    // An AST loaded from the cache assembles like the parsed one
+    Assembler ass;
+    ass.setCacheDir(dir.string());
+    ass.parse(source);
+    REQUIRE(ass.getErrors().empty());
+    auto const files = std::vector<fs::directory_entry>(
+        fs::directory_iterator(dir), fs::directory_iterator());
+    REQUIRE(files.size() == 1);
+    auto const file = files[0].path();
+    auto const old = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    fs::last_write_time(file, old);
+
+    Assembler ass2;
+    ass2.setCacheDir(dir.string());
+    ass2.parse(source);
+    REQUIRE(ass2.getErrors().empty());
+    // Loading marks the file as recently used
+    REQUIRE(fs::last_write_time(file) > old);
+    REQUIRE(ass2.getMachine().getSection("main").data ==
+            ass.getMachine().getSection("main").data);
+    REQUIRE(ass2.getSymbols().get<Number>("l299") ==
+            ass.getSymbols().get<Number>("l299"));
+    fs::remove_all(dir);
+
+    // Data from another version or grammar, or that does not fit its
+    // header, is not used. Header fields are 32 bit, with a 128 bit
+    // grammar hash after the magic and version.
+    Parser parser{grammar6502};
+    parser.use_cache(false);
+    auto* ast = parser.parse(source, "cache.asm");
+    REQUIRE(ast != nullptr);
+    auto const data = parser.saveAst(ast);
+    REQUIRE(parser.loadAst(data.data(), data.size()) != nullptr);
+
+    auto bad = data;
+    bad[4] ^= 1;
+    REQUIRE(parser.loadAst(bad.data(), bad.size()) == nullptr);
+    bad = data;
+    bad[8] ^= 1;
+    REQUIRE(parser.loadAst(bad.data(), bad.size()) == nullptr);
+    bad = data;
+    bad[36 + 3] = 0x7f; // Node count
+    REQUIRE(parser.loadAst(bad.data(), bad.size()) == nullptr);
+    REQUIRE(parser.loadAst(data.data(), data.size() - 4) == nullptr);
+    REQUIRE(parser.loadAst(data.data(), 20) == nullptr);
+}
+
+TEST_CASE("parser.cache_limit")
+{
+    auto dir = fs::temp_directory_path() / "_bass_cache_limit";
+    fs::remove_all(dir);
+    auto const a = cachedSource(200) + "; a\n";
+    auto const b = cachedSource(200) + "; b\n";
+    auto const c = cachedSource(200) + "; c\n";
+    auto const now = fs::file_time_type::clock::now();
+
+    Parser parser{grammar6502};
+    parser.set_cache_dir(dir.string());
+    auto cacheFile = [&](std::string const& source) {
+        auto hash = hash128(source.data(), source.size());
+        return dir / hex_encode(hash, static_cast<int>(hash.size()));
+    };
+
+    REQUIRE(parser.parse(a, "a.asm") != nullptr);
+    REQUIRE(parser.parse(b, "b.asm") != nullptr);
+    fs::last_write_time(cacheFile(a), now - std::chrono::hours(3));
+    fs::last_write_time(cacheFile(b), now - std::chrono::hours(2));
+    parser.set_cache_limit(fs::file_size(cacheFile(a)) * 5 / 2);
+
+    // Using `a` makes `b` the least recently used, so it is removed to
+    // make room for `c`
+    parser.clear();
+    REQUIRE(parser.parse(a, "a.asm") != nullptr);
+    REQUIRE(parser.parse(c, "c.asm") != nullptr);
+
+    // Files are renamed into place, so no temporary files are left
+    std::vector<fs::path> files;
+    for (auto const& entry : fs::directory_iterator(dir)) {
+        files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    std::vector<fs::path> expected{cacheFile(a), cacheFile(c)};
+    std::sort(expected.begin(), expected.end());
+    REQUIRE(files == expected);
+    fs::remove_all(dir);
+}
+
+TEST_CASE("assembler.preload")
+{
+    auto dir = fs::temp_directory_path() / "_bass_preload";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "sub");
+    auto write = [&](fs::path const& name, std::string const& text) {
+        utils::File f{(dir / name).string(), utils::File::Mode::Write};
+        f.writeString(text);
+    };
+    write("main.asm", R"(
+    !section "main", $800
+    !include "a.asm"
+    !include "sub/b.asm"
+    rts
+)");
+    write("a.asm", "a:  lda #1\n");
+    // Nested includes are relative to the including file
+    write("sub/b.asm", "    !include \"c.asm\"\nb:  ldx #2\n");
+    write("sub/c.asm", "c:  ldy #3\n    !include \"../a2.asm\"\n");
+    write("a2.asm", "    nop\n");
+    write("missing.asm", R"(
+    !section "main", $800
+    !include "sub/d.asm"
+)");
+    write("sub/d.asm", "    !include \"none.asm\"\n");
+
+    // Included files parsed in parallel give the same result as when
+    // they are parsed one by one
+    Assembler parallel;
+    parallel.setThreads(4);
+    parallel.parse_path(dir / "main.asm");
+    REQUIRE(parallel.getErrors().empty());
+    Assembler serial;
+    serial.setThreads(1);
+    serial.parse_path(dir / "main.asm");
+    REQUIRE(serial.getErrors().empty());
+    auto const& data = parallel.getMachine().getSection("main").data;
+    REQUIRE(data == serial.getMachine().getSection("main").data);
+    REQUIRE(data.size() == 8);
+    REQUIRE(data[4] == 0xea);
+    REQUIRE(parallel.getSymbols().get<Number>("b") == 0x805);
+
+    // Files that can not be loaded are still reported when included
+    Assembler ass;
+    ass.setThreads(4);
+    ass.parse_path(dir / "missing.asm");
+    auto errors = ass.getErrors();
+    REQUIRE(errors.size() == 1);
+    REQUIRE(errors[0].line == 1);
+    REQUIRE(errors[0].message.find("sub/none.asm") != std::string::npos);
+    fs::remove_all(dir);
+}
+
+TEST_CASE("parser.parallel")
+{
+    // Large enough to be parsed in parts
+    auto const source = cachedSource(3000) + R"(
+!macro twice(v) {
+    !rept 2 { lda #v }
+}
+    twice(7)
+    !if 1 {
+        nop
+    } else {
+        brk
+    }
+)";
+    REQUIRE(source.size() >= 64 * 1024);
+
+    // The parts, joined, are the same AST as the whole source
+    Parser parallel{grammar6502};
+    parallel.use_cache(false);
+    parallel.set_threads(4);
+    Parser serial{grammar6502};
+    serial.use_cache(false);
+    serial.set_threads(1);
+    auto* ast = parallel.parse(source, "big.asm");
+    REQUIRE(ast != nullptr);
+    auto* ast2 = serial.parse(source, "big.asm");
+    REQUIRE(ast2 != nullptr);
+    REQUIRE(parallel.saveAst(ast) == serial.saveAst(ast2));
+
+    Assembler ass;
+    ass.useCache(false);
+    ass.setThreads(4);
+    ass.parse(source);
+    REQUIRE(ass.getErrors().empty());
+    Assembler ass2;
+    ass2.useCache(false);
+    ass2.setThreads(1);
+    ass2.parse(source);
+    REQUIRE(ass2.getErrors().empty());
+    REQUIRE(ass.getMachine().getSection("main").data ==
+            ass2.getMachine().getSection("main").data);
+    REQUIRE(ass.getSymbols().get<Number>("l2999") ==
+            ass2.getSymbols().get<Number>("l2999"));
+}
+
+TEST_CASE("parser.packrat")
+{
+    auto const source = cachedSource(100) + R"(
+    f = [ x -> x * 2 ]
+    !byte f(3) + (1 + 2) * 3
+)";
+
+    // Only the selected rules are memoized
+    Assembler ass;
+    ass.useCache(false);
+    ass.parse(source);
+    REQUIRE(ass.getErrors().empty());
+    std::vector<std::string> rules;
+    size_t lookups = 0;
+    for (auto const& info : ass.packratStats()) {
+        rules.push_back(info.rule);
+        lookups += info.lookups;
+    }
+    std::sort(rules.begin(), rules.end());
+    REQUIRE(rules == std::vector<std::string>{"AsmSymbol", "Expression",
+                                              "FnCall", "Label", "Lambda",
+                                              "Variable"});
+    REQUIRE(lookups > 0);
+
+    // Without room for the tables, sources are parsed without them
+    Parser plain{grammar6502};
+    plain.use_cache(false);
+    Parser tiny{grammar6502};
+    tiny.use_cache(false);
+    tiny.packrat({"Expression", "Variable"}, 1);
+    auto* ast = plain.parse(source, "packrat.asm");
+    REQUIRE(ast != nullptr);
+    auto* ast2 = tiny.parse(source, "packrat.asm");
+    REQUIRE(ast2 != nullptr);
+    REQUIRE(plain.saveAst(ast) == tiny.saveAst(ast2));
+    auto const stats = Parser::packratStats({&tiny});
+    REQUIRE(stats.size() == 2);
+    for (auto const& info : stats) {
+        REQUIRE(info.lookups == 0);
+    }
+}
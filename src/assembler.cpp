@@ -4,18 +4,21 @@
 #include "machine.h"
 #include "parser.h"
 
-#ifndef _WIN32
-#    include <cxxabi.h>
-#endif
 #include <coreutils/file.h>
 #include <coreutils/log.h>
 #include <coreutils/split.h>
 #include <coreutils/text.h>
 #include <coreutils/utf8.h>
 
+#include <algorithm>
+#include <atomic>
 #include <charconv>
+#include <cmath>
+#include <cstring>
 #include <fmt/format.h>
+#include <limits>
 #include <string_view>
+#include <thread>
 #include <unordered_set>
 extern char const* const grammar6502;
 
@@ -31,13 +34,20 @@ Number operator"" _N(unsigned long long a)
 {
     return static_cast<Number>(a);
 }
-Number to_number(std::string_view txt)
+// Whole numbers are kept exact, and parsed without copying the text
+Value to_number(std::string_view txt)
 {
+    int64_t result{};
+    auto const* end = txt.data() + txt.size();
+    auto [ptr, ec] = std::from_chars(txt.data(), end, result);
+    if (ec == std::errc() && ptr == end) {
+        return result;
+    }
     std::string const t{txt};
     return static_cast<Number>(std::stod(t));
 }
 
-Number to_number(std::string_view txt, Base base, int skip = 0)
+int64_t to_number(std::string_view txt, Base base, int skip = 0)
 {
     int64_t result{};
     txt.remove_prefix(skip);
@@ -46,17 +56,18 @@ Number to_number(std::string_view txt, Base base, int skip = 0)
     if (ec != std::errc()) {
         throw parse_error("Number conversion");
     }
-    return static_cast<Number>(result);
+    return result;
 }
 
-std::string any_to_string(std::any const& val)
+std::string any_to_string(Value const& val)
 {
-    if (auto const* n = std::any_cast<Number>(&val)) {
-        auto in = static_cast<int64_t>(*n);
-        if (*n == static_cast<double>(in)) return fmt::format("${:x}", in);
+    if (auto const* i = value_cast<int64_t>(&val)) {
+        return fmt::format("${:x}", *i);
+    }
+    if (auto n = value_cast<Number>(&val)) {
         return fmt::format("{}", *n);
     }
-    if (auto const* v = std::any_cast<std::vector<uint8_t>>(&val)) {
+    if (auto const* v = value_cast<Bytes>(&val)) {
         std::string res = "[ ";
         int i = 0;
         for (auto const& b : *v) {
@@ -68,43 +79,29 @@ std::string any_to_string(std::any const& val)
         }
         return res + "]";
     }
-    if (auto const* s = std::any_cast<std::string_view>(&val)) {
+    if (auto const* s = value_cast<std::string_view>(&val)) {
         return "\""s + std::string(*s) + "\"";
     }
-    if (auto const* s = std::any_cast<std::string>(&val)) {
-        return "\""s + *s + "\"";
-    }
-
-#ifdef _WIN32
-    return val.type().name();
-#else
-    int status{};
-    const char* realname =
-        abi::__cxa_demangle(val.type().name(), nullptr, nullptr, &status);
-
-    return realname;
-#endif
+    return std::string(val.type_name());
 }
 
 template <typename T>
-std::any Assembler::slice(std::vector<T> const& v, int64_t a, int64_t b)
+Value Assembler::slice(Buffer<T> const& v, int64_t a, int64_t b)
 {
     if (b < 0) {
         b = v.size() + b + 1;
     }
-    if (a >= b || b > static_cast<int64_t>(v.size())) {
+    if (a < 0 || a >= b || b > static_cast<int64_t>(v.size())) {
         if (isFinalPass()) {
             throw parse_error("Slice outside array");
         }
         return any_num(0);
     }
-
-    std::vector<T> const nv(v.begin() + a, v.begin() + b);
-    return std::any(nv);
+    return v.slice(a, b);
 }
 
 template <typename T>
-std::any Assembler::index(std::vector<T> const& v, int64_t index)
+Value Assembler::index(Buffer<T> const& v, int64_t index)
 {
     if (index >= static_cast<int64_t>(v.size())) {
         if (isFinalPass()) {
@@ -161,13 +158,115 @@ Assembler::Block Assembler::includeFile(std::string_view name)
     return includes.at(fn);
 }
 
+// File names of all `!include` directives that take a string literal
+std::vector<std::string_view> Assembler::findIncludes(AstNode root) const
+{
+    std::vector<std::string_view> names;
+    auto const genericDecl = parser.ruleId("GenericDecl");
+    for_all_nodes(root, [&](AstNode node) {
+        if (SemanticValues{node}.rule() != genericDecl ||
+            SemanticValues{get_child(node, 0)}.token_view() != "!include") {
+            return;
+        }
+        auto arg = SemanticValues{get_child(node, 1)}.token_view();
+        arg.remove_suffix(arg.size() - (arg.find_last_not_of(" \t") + 1));
+        arg.remove_prefix(std::min(arg.find_first_not_of(" \t"), arg.size()));
+        if (arg.size() >= 2 && arg.front() == '"' &&
+            arg.find('"', 1) == arg.size() - 1) {
+            names.push_back(arg.substr(1, arg.size() - 2));
+        }
+    });
+    return names;
+}
+
+// Parse the files included by `root`, and the files they include, on
+// worker threads before the first pass needs them. Files that can not
+// be read or parsed are left to includeFile(), which reports the error.
+void Assembler::preloadIncludes(AstNode root)
+{
+    std::vector<std::pair<AstNode, fs::path>> scan{{root, currentPath}};
+    while (!scan.empty()) {
+        std::vector<std::string> files;
+        for (auto const& [ast, dir] : scan) {
+            for (auto name : findIncludes(ast)) {
+                auto p = fs::path(name);
+                if (p.is_relative()) {
+                    p = dir / p;
+                }
+                auto fn = p.string();
+                if (includes.count(fn) == 0 &&
+                    std::find(files.begin(), files.end(), fn) == files.end()) {
+                    files.push_back(fn);
+                }
+            }
+        }
+        scan.clear();
+        if (files.empty()) {
+            break;
+        }
+
+        auto count = std::min<size_t>(
+            files.size(),
+            threads != 0 ? threads
+                         : std::max(1U, std::thread::hardware_concurrency()));
+        while (workers.size() < count) {
+            workers.push_back(parser.clone());
+        }
+
+        std::vector<std::string> sources(files.size());
+        std::vector<AstNode> asts(files.size(), nullptr);
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < count; t++) {
+            threads.emplace_back([&, t] {
+                auto& worker = *workers[t];
+                for (size_t i = next++; i < files.size(); i = next++) {
+                    try {
+                        utils::File f{files[i]};
+                        sources[i] = f.readAllString();
+                        asts[i] = worker.parse(sources[i], files[i]);
+                    } catch (std::exception&) {
+                        asts[i] = nullptr;
+                    }
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        // Move the results to our parser in file order, so the outcome
+        // does not depend on which worker finished first
+        for (size_t i = 0; i < files.size(); i++) {
+            if (asts[i] == nullptr) {
+                continue;
+            }
+            stored_includes.push_back(std::move(sources[i]));
+            std::string_view const source = stored_includes.back();
+            auto* ast = parser.copyAst(asts[i], source, files[i]);
+            includes[files[i]] = Block{source, 1, ast};
+            scan.emplace_back(ast, fs::path(files[i]).parent_path());
+        }
+        for (size_t t = 0; t < count; t++) {
+            workers[t]->clear();
+        }
+    }
+}
+
+// Snippets are parsed once, and their ASTs reused in later passes
 void Assembler::evaluateCode(std::string const& source, std::string const& name)
 {
-    auto ast = parser.parse(source, name);
-    if (ast == nullptr) {
-        throw parse_error("");
+    auto it = snippets.find(source);
+    if (it == snippets.end()) {
+        // The AST refers to the text, so parse the copy in the map
+        it = snippets.emplace(source, nullptr).first;
+        it->second = parser.parse(it->first, name);
+        if (it->second == nullptr) {
+            snippets.erase(it);
+            throw parse_error("");
+        }
     }
-    parser.evaluate(ast);
+    parser.evaluate(it->second);
 }
 
 void Assembler::evaluateBlock(Block const& block)
@@ -240,35 +339,93 @@ void Assembler::runTest(Test const& test)
     }
 }
 
-std::any Assembler::applyDefine(Macro const& fn, Call const& call)
+size_t Assembler::MemoHash::operator()(MemoKey const& key) const
 {
-    AnyMap shadowed;
-    std::vector<std::string> args{fn.args.begin(), fn.args.end()};
-    for (unsigned i = 0; i < call.args.size(); i++) {
-        if (syms.is_defined(args[i])) {
-            errors.emplace_back(
-                0, 0,
-                fmt::format("Function '{}' shadows global symbol {}", call.name,
-                            fn.args[i]),
-                ErrLevel::Warning);
-            shadowed[args[i]] = syms.get(args[i]);
-            syms.erase(args[i]);
-        }
-        syms.set(args[i], call.args[i]);
+    size_t h = 0;
+    for (auto k : key) {
+        h = h * 31 + std::hash<uint64_t>()(k);
     }
+    return h;
+}
 
-    // auto res = evaluateExpression(fn.contents);
-    auto res = parser.evaluate(fn.contents.node);
+bool Assembler::memoKey(std::vector<Value> const& args, MemoKey& key)
+{
+    if (args.size() >= key.size()) {
+        return false;
+    }
+    key = {args.size(), 0, 0, 0};
+    for (size_t i = 0; i < args.size(); i++) {
+        if (auto const* n = value_cast<int64_t>(&args[i])) {
+            key[i + 1] = static_cast<uint64_t>(*n);
+        } else if (auto d = value_cast<Number>(&args[i])) {
+            key[0] |= 0x100 << i;
+            std::memcpy(&key[i + 1], &*d, sizeof(Number));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
 
-    for (unsigned i = 0; i < call.args.size(); i++) {
-        syms.erase(args[i]);
+// Return the result of `fn` for `args`, calling it only the first time
+// if the memo is pure
+template <typename FN>
+Value Assembler::memoized(Memo& memo, std::vector<Value> const& args,
+                          FN const& fn)
+{
+    MemoKey key;
+    if (!memoizing || !memo.pure || !memoKey(args, key)) {
+        return fn();
+    }
+    auto it = memo.results.find(key);
+    if (it != memo.results.end()) {
+        return it->second;
     }
-    for (auto const& shadow : shadowed) {
-        syms.set(shadow.first, shadow.second);
+    // Results that depend on the pass, like a division by zero that is
+    // only an error in the final pass, are not kept
+    auto const checks = passChecks;
+    auto res = fn();
+    if (passChecks == checks) {
+        memo.results.emplace(key, res);
     }
     return res;
 }
 
+// Lambdas that only use their arguments, constants and pure functions
+// give the same result for the same arguments
+Value Assembler::applyDefine(Macro const& fn, Call const& call)
+{
+    auto& memo = memos[fn.contents.node];
+    if (!memo.checked) {
+        auto const variableRule = parser.ruleId("Variable");
+        memo.pure = parser.isPure(fn.contents.node, [&](auto const& sv) {
+            auto name = sv.token_view().substr(0, sv.token_view().find('.'));
+            return sv.rule() == variableRule &&
+                   std::find(fn.args.begin(), fn.args.end(), name) !=
+                       fn.args.end();
+        });
+        memo.checked = true;
+    }
+    return memoized(memo, call.args, [&] {
+        Bind const bind{*this, fn.args, call.args};
+        return parser.evaluate(fn.contents.node);
+    });
+}
+
+Value const* Assembler::findBound(std::string_view name) const
+{
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        auto const& names = *it->names;
+        auto n = std::min(names.size(), it->values->size());
+        for (size_t i = 0; i < n; i++) {
+            if (names[i] == name) {
+                return &(*it->values)[i];
+            }
+        }
+    }
+    return nullptr;
+}
+
 void Assembler::applyMacro(Call const& call)
 {
     auto it = macros.find(call.name);
@@ -290,22 +447,7 @@ void Assembler::applyMacro(Call const& call)
         throw parse_error("Wrong number of arguments");
     }
 
-    std::unordered_map<std::string_view, Symbol> shadowed;
-
-    for (unsigned i = 0; i < call.args.size(); i++) {
-
-        if (auto sym = syms.get_sym(m.args[i])) {
-            // if (sym != nullptr) {
-            errors.emplace_back(
-                0, 0,
-                fmt::format("Macro '{}' shadows global symbol {}", call.name,
-                            m.args[i]),
-                ErrLevel::Warning);
-            shadowed[m.args[i]] = *sym;
-            syms.erase(m.args[i]);
-        }
-        syms.set(m.args[i], call.args[i]);
-    }
+    Bind const bind{*this, m.args, call.args};
 
     auto ll = lastLabel;
     auto pc = mach->getPC();
@@ -314,13 +456,6 @@ void Assembler::applyMacro(Call const& call)
     inMacro++;
     parser.evaluate(m.contents.node);
     inMacro--;
-
-    for (unsigned i = 0; i < call.args.size(); i++) {
-        syms.erase(m.args[i]);
-    }
-    for (auto const& shadow : shadowed) {
-        syms.set_sym(shadow.first, shadow.second);
-    }
     lastLabel = ll;
 }
 void Assembler::defineMacro(std::string_view name,
@@ -334,7 +469,7 @@ void initMeta(Assembler& assem);
 void initFunctions(Assembler& ass);
 void registerLuaFunctions(Assembler& text, Scripting& scripting);
 
-void Assembler::setRegSymbols()
+void Assembler::setRegSymbols(bool ram)
 {
     using sixfive::Reg;
     syms.erase("A");
@@ -350,7 +485,9 @@ void Assembler::setRegSymbols()
     syms.set("SR", num(mach->getReg(Reg::SR)));
     syms.set("SP", num(mach->getReg(Reg::SP)));
     syms.set("PC", num(mach->getReg(Reg::PC)));
-    syms.set("RAM", mach->getRam());
+    if (ram) {
+        syms.set("RAM", mach->getRam());
+    }
 }
 
 void Assembler::machineLog(std::string_view text)
@@ -364,37 +501,46 @@ void Assembler::machineLog(std::string_view text)
     fmt::vprint(std::string(text) + "\n", store);
 }
 
-Assembler::Assembler() : parser(grammar6502)
+// Rules that are often tried again at the same position, and are costly
+// enough that memoizing them pays off. See --packrat-stats.
+static std::vector<std::string> const memoizedRules = {
+    "AsmSymbol", "Expression", "FnCall", "Label", "Lambda", "Variable"};
+
+// Memory for memoized results when parsing one source. Beyond this, the
+// parser falls back to plain recursive descent.
+constexpr size_t PackratLimit = 64 * 1024 * 1024;
+
+Assembler::Assembler() : parser(grammar6502), scripting(strings)
 {
     lines.resize(0x10000);
-    parser.packrat();
+    parser.packrat(memoizedRules, PackratLimit);
     mach = std::make_shared<Machine>();
 
     checkFunction = [this](uint32_t) {
         auto pc = mach->getReg(sixfive::Reg::PC);
         for (auto const& action : actions[pc]) {
-            auto saved = syms;
-            setRegSymbols();
+            if (std::holds_alternative<Log>(action.action)) {
+                machineLog(std::get<Log>(action.action).text);
+                continue;
+            }
+            SymbolTable::Rollback const rollback{syms};
             if (std::holds_alternative<Check>(action.action)) {
                 auto const& check = std::get<Check>(action.action);
+                setRegSymbols(check.ram);
                 auto v = parser.evaluate(check.expression.node);
                 // evaluateExpression(check.expression, action.line);
                 if (!number<bool>(v)) {
-                    syms = saved;
                     errors.emplace_back(action.line, 0,
                                         fmt::format("Check '{}' failed",
                                                     check.expression.contents));
                     errors.back().file = fileName;
                     throw parse_error("!check");
                 }
-            } else if (std::holds_alternative<Log>(action.action)) {
-                auto const& log = std::get<Log>(action.action);
-                machineLog(log.text);
             } else {
+                setRegSymbols(true);
                 auto const& fn = std::get<std::function<void()>>(action.action);
                 fn();
             }
-            syms = saved;
         }
         return false;
     };
@@ -415,24 +561,68 @@ void Assembler::useCache(bool on)
     parser.use_cache(on);
 }
 
-void Assembler::handleLabel(std::any const& lbl)
+void Assembler::setCacheDir(std::string const& dir)
+{
+    parser.set_cache_dir(dir);
+}
+
+void Assembler::setCacheSize(uint64_t bytes)
+{
+    parser.set_cache_limit(bytes);
+}
+
+void Assembler::collectPackratStats()
+{
+    parser.packrat();
+}
+
+std::vector<PackratInfo> Assembler::packratStats() const
+{
+    std::vector<Parser const*> parsers{&parser};
+    for (auto const& worker : workers) {
+        parsers.push_back(worker.get());
+    }
+    return Parser::packratStats(parsers);
+}
+
+void Assembler::profileGrammar()
+{
+    parser.profile();
+}
+
+std::vector<RuleProfile> Assembler::grammarProfile() const
+{
+    std::vector<Parser const*> parsers{&parser};
+    for (auto const& worker : workers) {
+        parsers.push_back(worker.get());
+    }
+    return Parser::profileStats(parsers);
+}
+
+void Assembler::useIncremental(bool on)
+{
+    parser.use_incremental(on);
+}
+
+void Assembler::handleLabel(Value const& lbl)
 {
     if (auto const* p =
-            std::any_cast<std::pair<std::string_view, int32_t>>(&lbl)) {
+            value_cast<std::pair<std::string_view, int32_t>>(&lbl)) {
         // Indexed symbol: Label is array of values
         if (!syms.is_defined(p->first)) {
             syms.set(p->first, std::vector<Number>{});
         }
-        auto& vec = syms.get<std::vector<Number>>(p->first);
-        if (static_cast<int32_t>(vec.size()) <= p->second) {
-            vec.resize(p->second + 1);
-        }
-        vec[p->second] = static_cast<Number>(mach->getPC());
+        syms.get<Numbers>(p->first).edit([&](std::vector<Number>& vec) {
+            if (static_cast<int32_t>(vec.size()) <= p->second) {
+                vec.resize(p->second + 1);
+            }
+            vec[p->second] = static_cast<Number>(mach->getPC());
+        });
         // LOGI("setting %s[%d] -> %d", p->first, p->second, (int)vec[0]);
         return;
     }
 
-    std::string label{std::any_cast<std::string_view>(lbl)};
+    std::string label{value_cast<std::string_view>(lbl)};
 
     if (label == "$" || label == "-" || label == "+") {
         ::Check(inMacro == 0, "No special labels in macro");
@@ -443,14 +633,15 @@ void Assembler::handleLabel(std::any const& lbl)
             ::Check(!lastLabel.empty(), "Local label without global label");
             label = std::string(lastLabel) + label;
         } else {
-            lastLabel = std::any_cast<std::string_view>(lbl);
+            lastLabel = value_cast<std::string_view>(lbl);
         }
     }
-    ::Check(syms.is_redefinable(label),
+    auto const atom = syms.atom(label);
+    ::Check(syms.is_redefinable(atom),
             fmt::format("already defined label '{}'", label));
     // LOGI("Label %s=%x", label, mach->getPC());
-    syms.set(label, static_cast<Number>(mach->getPC()));
-    syms.set_final(label);
+    syms.set(atom, static_cast<int64_t>(mach->getPC()));
+    syms.set_final(atom);
     if (pendingTest != nullptr) {
         auto* test = pendingTest;
         pendingTest = nullptr;
@@ -467,128 +658,538 @@ void Assembler::handleLabel(std::any const& lbl)
     }
 }
 
-std::vector<uint8_t> operator+(const std::vector<uint8_t>& lhs,
-                               const std::vector<uint8_t>& rhs)
+template <typename T>
+Buffer<T> operator+(Buffer<T> const& lhs, Buffer<T> const& rhs)
 {
-    std::vector<uint8_t> result = lhs;
+    std::vector<T> result;
     result.reserve(lhs.size() + rhs.size());
+    result.insert(result.end(), lhs.begin(), lhs.end());
     result.insert(result.end(), rhs.begin(), rhs.end());
     return result;
 }
 
-std::vector<Number> operator+(const std::vector<Number>& lhs,
-                               const std::vector<Number>& rhs)
+Operator to_operator(std::string_view ope)
 {
-    std::vector<Number> result = lhs;
-    result.reserve(lhs.size() + rhs.size());
-    result.insert(result.end(), rhs.begin(), rhs.end());
-    return result;
+    static std::unordered_map<std::string_view, Operator> const operators{
+        {"+", Operator::Add},     {"-", Operator::Sub},
+        {"*", Operator::Mul},     {"/", Operator::Div},
+        {"%", Operator::Mod},     {"\\", Operator::IDiv},
+        {"<<", Operator::Shl},    {">>", Operator::Shr},
+        {"&", Operator::And},     {"|", Operator::Or},
+        {"^", Operator::Xor},     {"&&", Operator::LogAnd},
+        {"||", Operator::LogOr},  {"==", Operator::Eq},
+        {"!=", Operator::Ne},     {"<", Operator::Lt},
+        {">", Operator::Gt},      {"<=", Operator::Le},
+        {">=", Operator::Ge},     {":", Operator::Join}};
+    auto it = operators.find(ope);
+    if (it == operators.end()) {
+        throw parse_error("Unknown operator");
+    }
+    return it->second;
 }
 
-template <typename A, typename B>
-A do_op(std::string_view ope, A const& a, B const& b)
-{
-    if (ope == "+") return a + b;
-    if (ope == "==") return a == b;
-    if (ope == "!=") return a != b;
-    if (ope == "-") return a - b;
-    if (ope == "*") return a * b;
-    if (ope == "/") return a / b;
-    if (ope == "%") return a % b;
-    if (ope == ">>") return a >> b;
-    if (ope == "<<") return a << b;
-    if (ope == "&") return a & b;
-    if (ope == "|") return a | b;
-    if (ope == "^") return a ^ b;
-    if (ope == "&&") return a && b;
-    if (ope == "||") return a || b;
-    if (ope == "<") return a < b;
-    if (ope == ">") return a > b;
-    if (ope == "<=") return a <= b;
-    if (ope == ">=") return a >= b;
-    if (ope == "\\") return div(a, b);
-    if (ope == ":") return (a<<16) | b;
-    return {};
+using NumberKernel = Number (*)(Num, Num);
+
+// Operators on two numbers, indexed by Operator
+constexpr NumberKernel numberKernels[] = {
+    [](Num a, Num b) { return static_cast<Number>(a + b); },
+    [](Num a, Num b) { return static_cast<Number>(a - b); },
+    [](Num a, Num b) { return static_cast<Number>(a * b); },
+    [](Num a, Num b) { return static_cast<Number>(a / b); },
+    [](Num a, Num b) { return static_cast<Number>(a % b); },
+    [](Num a, Num b) { return static_cast<Number>(div(a, b)); },
+    [](Num a, Num b) { return static_cast<Number>(a << b); },
+    [](Num a, Num b) { return static_cast<Number>(a >> b); },
+    [](Num a, Num b) { return static_cast<Number>(a & b); },
+    [](Num a, Num b) { return static_cast<Number>(a | b); },
+    [](Num a, Num b) { return static_cast<Number>(a ^ b); },
+    [](Num a, Num b) { return static_cast<Number>(a && b); },
+    [](Num a, Num b) { return static_cast<Number>(a || b); },
+    [](Num a, Num b) { return static_cast<Number>(a == b); },
+    [](Num a, Num b) { return static_cast<Number>(a != b); },
+    [](Num a, Num b) { return static_cast<Number>(a < b); },
+    [](Num a, Num b) { return static_cast<Number>(a > b); },
+    [](Num a, Num b) { return static_cast<Number>(a <= b); },
+    [](Num a, Num b) { return static_cast<Number>(a >= b); },
+    [](Num a, Num b) { return static_cast<Number>((a << 16) | b); },
+};
+static_assert(std::size(numberKernels) ==
+              static_cast<size_t>(Operator::Count));
+
+constexpr int64_t int32Min = std::numeric_limits<int32_t>::min();
+constexpr int64_t int32Max = std::numeric_limits<int32_t>::max();
+constexpr int64_t int64Min = std::numeric_limits<int64_t>::min();
+constexpr int64_t int64Max = std::numeric_limits<int64_t>::max();
+
+// Results that do not fit in 64 bits are computed as Numbers
+Value add(int64_t a, int64_t b)
+{
+    if ((b > 0 && a > int64Max - b) || (b < 0 && a < int64Min - b)) {
+        return static_cast<Number>(a) + static_cast<Number>(b);
+    }
+    return a + b;
 }
 
-AsmValue operation(std::string_view ope, AsmValue const& a, AsmValue const& b)
+Value sub(int64_t a, int64_t b)
 {
-    return std::visit([&](auto&& a0, auto&& b0) -> AsmValue {
-        using A = std::decay_t<decltype(a0)>;
-        using B = std::decay_t<decltype(b0)>;
-        if constexpr (std::is_same_v<A, B>) {
-            if constexpr (std::is_arithmetic_v<A>) {
-                return static_cast<A>(do_op(ope, Num(a0), Num(b0)));
-            } else {
-                if (ope == "+") return a0 + b0;
-                if (ope == "==") return static_cast<Number>(a0 == b0);
-                if (ope == "!=") return static_cast<Number>(a0 != b0);
+    if ((b < 0 && a > int64Max + b) || (b > 0 && a < int64Min + b)) {
+        return static_cast<Number>(a) - static_cast<Number>(b);
+    }
+    return a - b;
+}
+
+Value mul(int64_t a, int64_t b)
+{
+    bool const small = a >= int32Min && a <= int32Max && b >= int32Min &&
+                       b <= int32Max;
+    auto const n = static_cast<Number>(a) * static_cast<Number>(b);
+    if (!small && std::abs(n) >= 0x1p62) {
+        return n;
+    }
+    return a * b;
+}
+
+// Quotients with a remainder are Numbers
+Value quotient(int64_t a, int64_t b)
+{
+    DBZ(b);
+    if (b == -1 || a % b != 0) {
+        return static_cast<Number>(a) / static_cast<Number>(b);
+    }
+    return a / b;
+}
+
+using IntegerKernel = Value (*)(int64_t, int64_t);
+
+// Operators on two integers, indexed by Operator. They give the same
+// results as the number kernels, but stay exact above 2^53.
+constexpr IntegerKernel integerKernels[] = {
+    add,
+    sub,
+    mul,
+    quotient,
+    [](int64_t a, int64_t b) -> Value {
+        DBZ(b);
+        return b == -1 ? 0 : a % b;
+    },
+    [](int64_t a, int64_t b) -> Value {
+        DBZ(b);
+        return b == -1 ? -static_cast<Number>(a) : a / b;
+    },
+    [](int64_t a, int64_t b) -> Value { return a << b; },
+    [](int64_t a, int64_t b) -> Value { return a >> b; },
+    [](int64_t a, int64_t b) -> Value { return a & b; },
+    [](int64_t a, int64_t b) -> Value { return a | b; },
+    [](int64_t a, int64_t b) -> Value { return a ^ b; },
+    [](int64_t a, int64_t b) -> Value { return a != 0 && b != 0; },
+    [](int64_t a, int64_t b) -> Value { return a != 0 || b != 0; },
+    [](int64_t a, int64_t b) -> Value { return a == b; },
+    [](int64_t a, int64_t b) -> Value { return a != b; },
+    [](int64_t a, int64_t b) -> Value { return a < b; },
+    [](int64_t a, int64_t b) -> Value { return a > b; },
+    [](int64_t a, int64_t b) -> Value { return a <= b; },
+    [](int64_t a, int64_t b) -> Value { return a >= b; },
+    [](int64_t a, int64_t b) -> Value { return (a << 16) | b; },
+};
+static_assert(std::size(integerKernels) ==
+              static_cast<size_t>(Operator::Count));
+
+// Operators on two strings or two arrays of the same type. Strings are
+// added by `operation()`.
+template <typename T>
+Value sequenceOp(Operator ope, T const& a, T const& b)
+{
+    switch (ope) {
+    case Operator::Add:
+        if constexpr (std::is_same_v<T, std::string_view>) {
+            return any_num(0);
+        } else {
+            return a + b;
+        }
+    case Operator::Eq:
+        return a == b;
+    case Operator::Ne:
+        return a != b;
+    default:
+        return any_num(0);
+    }
+}
+
+// Operators on an array and a number; `*` repeats the array
+template <typename T>
+Value repeatOp(Operator ope, Buffer<T> const& a, Number b)
+{
+    if (ope != Operator::Mul) {
+        return any_num(0);
+    }
+    std::vector<T> res;
+    for (int i = 0; i < b; i++) {
+        res.insert(res.end(), a.begin(), a.end());
+    }
+    return res;
+}
+
+bool is_sequence(Value const& v)
+{
+    return v.is<std::string_view>() || v.is<Bytes>() ||
+           v.is<Numbers>();
+}
+
+// Values of other types take part in operations as 0
+Number to_operand(Value const& v)
+{
+    return value_cast<Number>(&v).value_or(0);
+}
+
+Value operation(Operator ope, Value const& a, Value const& b,
+                StringArena& strings)
+{
+    if (auto const* s = value_cast<std::string_view>(&a)) {
+        if (auto const* t = value_cast<std::string_view>(&b)) {
+            if (ope == Operator::Add) {
+                return strings.persist(std::string(*s) + std::string(*t));
             }
-        } else if constexpr (std::is_arithmetic_v<B> && !std::is_same_v<A, std::string_view>) {
-            if (ope == "*") {
-                A res;
-                for(int i=0; i<b0; i++) {
-                    res.insert(res.end(), a0.begin(), a0.end());
+            return sequenceOp(ope, *s, *t);
+        }
+    } else if (auto const* v8 = value_cast<Bytes>(&a)) {
+        if (auto const* w8 = value_cast<Bytes>(&b)) {
+            return sequenceOp(ope, *v8, *w8);
+        }
+        if (!is_sequence(b)) {
+            return repeatOp(ope, *v8, to_operand(b));
+        }
+    } else if (auto const* vn = value_cast<Numbers>(&a)) {
+        if (auto const* wn = value_cast<Numbers>(&b)) {
+            return sequenceOp(ope, *vn, *wn);
+        }
+        if (!is_sequence(b)) {
+            return repeatOp(ope, *vn, to_operand(b));
+        }
+    } else if (!is_sequence(b)) {
+        return numberKernels[static_cast<size_t>(ope)](to_operand(a),
+                                                        to_operand(b));
+    }
+    return any_num(0);
+}
+
+// `a = a <ope> b` for each element
+void columnOp(Operator ope, std::vector<Number>& a,
+              std::vector<Number> const& b)
+{
+    switch (ope) {
+    case Operator::Add:
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] += b[i];
+        }
+        break;
+    case Operator::Sub:
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] -= b[i];
+        }
+        break;
+    case Operator::Mul:
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] *= b[i];
+        }
+        break;
+    default: {
+        auto const kernel = numberKernels[static_cast<size_t>(ope)];
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] = kernel(a[i], b[i]);
+        }
+    }
+    }
+}
+
+using TableFunction = void (*)(std::vector<std::vector<Number>>&);
+
+template <Number (*FN)(Number)>
+void tableFunction(std::vector<std::vector<Number>>& args)
+{
+    for (auto& x : args[0]) {
+        x = FN(x);
+    }
+}
+
+template <Number (*FN)(Number, Number)>
+void tableFunction2(std::vector<std::vector<Number>>& args)
+{
+    for (size_t i = 0; i < args[0].size(); i++) {
+        args[0][i] = FN(args[0][i], args[1][i]);
+    }
+}
+
+// Built-in functions that tables compute a column at a time, and their
+// number of arguments
+std::unordered_map<std::string_view, std::pair<TableFunction, size_t>> const
+    tableFunctions = {
+        {"sin", {tableFunction<std::sin>, 1}},
+        {"cos", {tableFunction<std::cos>, 1}},
+        {"tan", {tableFunction<std::tan>, 1}},
+        {"asin", {tableFunction<std::asin>, 1}},
+        {"acos", {tableFunction<std::acos>, 1}},
+        {"atan", {tableFunction<std::atan>, 1}},
+        {"sqrt", {tableFunction<std::sqrt>, 1}},
+        {"exp", {tableFunction<std::exp>, 1}},
+        {"log", {tableFunction<std::log>, 1}},
+        {"floor", {tableFunction<std::floor>, 1}},
+        {"ceil", {tableFunction<std::ceil>, 1}},
+        {"round", {tableFunction<std::round>, 1}},
+        {"trunc", {tableFunction<std::trunc>, 1}},
+        {"abs", {tableFunction<std::fabs>, 1}},
+        {"pow", {tableFunction2<std::pow>, 2}},
+        {"min", {tableFunction2<std::fmin>, 2}},
+        {"max", {tableFunction2<std::fmax>, 2}},
+        {"clamp",
+         {[](std::vector<std::vector<Number>>& args) {
+              for (size_t i = 0; i < args[0].size(); i++) {
+                  args[0][i] =
+                      std::min(std::max(args[0][i], args[1][i]), args[2][i]);
+              }
+          },
+          3}},
+};
+
+// Call `fn` for every value in `range`, which is a count or an array.
+// Lambdas of one argument that only use arithmetic, built-in math
+// functions and symbols are computed a whole column at a time, without
+// evaluating the lambda for each value.
+std::vector<Number> Assembler::evaluateTable(Macro const& fn,
+                                             Value const& range)
+{
+    std::vector<Number> input;
+    if (auto const* bytes = value_cast<Bytes>(&range)) {
+        input.assign(bytes->begin(), bytes->end());
+    } else if (auto const* numbers = value_cast<Numbers>(&range)) {
+        input.assign(numbers->begin(), numbers->end());
+    } else {
+        input.resize(number<size_t>(range));
+        for (size_t i = 0; i < input.size(); i++) {
+            input[i] = static_cast<Number>(i);
+        }
+    }
+    auto const count = input.size();
+
+    auto const expression = parser.ruleId("Expression");
+    auto const expression2 = parser.ruleId("Expression2");
+    auto const atom = parser.ruleId("Atom");
+    auto const unary = parser.ruleId("Unary");
+    auto const unary2 = parser.ruleId("Unary2");
+    auto const fnCall = parser.ruleId("FnCall");
+    auto const callArg = parser.ruleId("CallArg");
+    auto const variable = parser.ruleId("Variable");
+
+    using Column = std::vector<Number>;
+    std::function<bool(AstNode, Column&)> column = [&](AstNode node,
+                                                       Column& out) {
+        SemanticValues const sv{node};
+        auto const rule = sv.rule();
+        auto const* first = get_child(node, 0);
+        auto const single = first != nullptr && get_child(node, 1) == nullptr;
+
+        if (rule == variable && sv.token_view() == fn.args[0]) {
+            out = input;
+            return true;
+        }
+        if (rule == variable ||
+            parser.isPure(node, [](auto const&) { return false; })) {
+            auto const value = parser.evaluate(node);
+            auto n = value_cast<Number>(&value);
+            if (!n) {
+                return false;
+            }
+            out.assign(count, *n);
+            return true;
+        }
+        if (single && (rule == expression || rule == expression2 ||
+                       rule == atom || rule == callArg)) {
+            return column(get_child(node, 0), out);
+        }
+        if (rule == expression2 && get_child(node, 3) == nullptr &&
+            get_child(node, 2) != nullptr) {
+            Column rhs;
+            if (!column(get_child(node, 0), out) ||
+                !column(get_child(node, 2), rhs)) {
+                return false;
+            }
+            auto ope = SemanticValues{get_child(node, 1)}.token_view();
+            columnOp(to_operator(ope), out, rhs);
+            return true;
+        }
+        if ((rule == unary || rule == unary2) && !single &&
+            get_child(node, 2) == nullptr) {
+            if (!column(get_child(node, 1), out)) {
+                return false;
+            }
+            auto ope = SemanticValues{get_child(node, 0)}.token_view()[0];
+            for (auto& x : out) {
+                auto i = static_cast<int64_t>(x);
+                switch (ope) {
+                case '-':
+                    x = -x;
+                    break;
+                case '~':
+                    x = static_cast<Number>(~i & 0xffffffff);
+                    break;
+                case '!':
+                    x = i == 0 ? 1 : 0;
+                    break;
+                case '<':
+                    x = static_cast<Number>(i & 0xff);
+                    break;
+                case '>':
+                    x = static_cast<Number>(i >> 8);
+                    break;
+                default:
+                    return false;
                 }
-                return res;
             }
+            return true;
+        }
+        if (rule == fnCall && single) {
+            auto* call = get_child(node, 0);
+            auto name = SemanticValues{get_child(call, 0)}.token_view();
+            auto it = tableFunctions.find(name);
+            if (it == tableFunctions.end() || findBound(name) != nullptr ||
+                syms.get_sym(name) ||
+                functions.count(std::string(name)) == 0) {
+                return false;
+            }
+            auto const [function, argCount] = it->second;
+            auto* args = get_child(call, 1);
+            std::vector<Column> columns(argCount);
+            for (size_t i = 0; i < argCount; i++) {
+                auto* arg = args == nullptr ? nullptr : get_child(args, i);
+                if (arg == nullptr || !column(arg, columns[i])) {
+                    return false;
+                }
+            }
+            if (args != nullptr && get_child(args, argCount) != nullptr) {
+                return false;
+            }
+            function(columns);
+            out = std::move(columns[0]);
+            return true;
         }
-        return {};
-        }, a, b);
+        return false;
+    };
+
+    // Like in Expression2, errors may go away when labels are known
+    Column result;
+    try {
+        if (fn.args.size() == 1 && column(fn.contents.node, result)) {
+            return result;
+        }
+    } catch (std::out_of_range&) {
+        if (isFinalPass()) {
+            throw parse_error("Out of range");
+        }
+        return Column(count, 0);
+    } catch (dbz_error&) {
+        if (isFinalPass()) {
+            throw parse_error("Division by zero");
+        }
+        return Column(count, 0);
+    }
+
+    result.resize(count);
+    Call call;
+    call.args.resize(std::max<size_t>(fn.args.size(), 1));
+    for (size_t i = 0; i < count; i++) {
+        call.args[0] = any_num(input[i]);
+        result[i] = number(applyDefine(fn, call));
+    }
+    return result;
 }
 
-void Assembler::setSym(std::string_view sym, std::any val)
+// Lambdas in symbols hide functions, which hide Lua functions
+Assembler::CallSite Assembler::resolveCall(std::string_view name)
+{
+    CallSite site{};
+    site.version = syms.version;
+    bool found = false;
+
+    if (auto sym = syms.get_sym(name)) {
+        if (sym->value.is<Macro>()) {
+            site.kind = CallSite::LAMBDA;
+            site.lambda = sym->value;
+            return site;
+        }
+        found = true;
+    }
+
+    auto it = functions.find(std::string(name));
+    if (it != functions.end()) {
+        site.kind = CallSite::FUNCTION;
+        site.function = &it->second;
+        site.pure = pureFunctions.count(name) > 0;
+        return site;
+    }
+
+    if (scripting.hasFunction(name)) {
+        site.kind = CallSite::SCRIPT;
+        return site;
+    }
+
+    if (found) {
+        throw parse_error(fmt::format("'{}' is not callable", name));
+    }
+
+    throw parse_error(fmt::format("Unknown function '{}'", name));
+}
+
+void Assembler::setSym(std::string_view sym, Value const& val)
 {
     if (sym[0] == '.') {
-        syms.set(std::string(lastLabel) + sym, val);
+        syms.set(std::string(lastLabel) + std::string(sym), val);
     } else
     if (!scopes.empty()) {
-        syms.set(std::string(scopes.back()) + "." + sym, val);
+        syms.set(std::string(scopes.back()) + "." + std::string(sym), val);
         // LOGI("Prefixed to %s", sym);
     } else {
         syms.set(sym, val);
     }
 }
 
-AsmValue to_variant(std::any const& a)
+AsmValue to_variant(Value const& a)
 {
-    if (auto const* n = std::any_cast<Number>(&a))
+    if (auto n = value_cast<Number>(&a))
     {
         return *n;
     }
-    if (auto const* sv = std::any_cast<std::string_view>(&a))
+    if (auto const* sv = value_cast<std::string_view>(&a))
     {
         return *sv;
     }
-    if (auto const* v8 = std::any_cast<std::vector<uint8_t>>(&a))
+    if (auto const* v8 = value_cast<Bytes>(&a))
     {
-        return *v8;
+        return v8->vector();
     }
-    if (auto const* vn = std::any_cast<std::vector<Number>>(&a))
+    if (auto const* vn = value_cast<Numbers>(&a))
     {
-        return *vn;
+        return vn->vector();
     }
     return {};
 }
 
 void Assembler::setupRules()
 {
-    using std::any_cast;
     using SV = const SemanticValues;
     using namespace std::string_literals;
 
     parser.before("NonEmptyLine", [this](SV& sv) {
         auto pc = mach->getPC();
-        lines[pc & 0xffff] = std::make_pair(sv.file_name(), sv.line());
+        lines[pc & 0xffff] =
+            std::make_pair(std::string(sv.file_name()), sv.line());
         return true;
     });
 
     parser.after("AssignLine", [this](SV& sv) {
         if (sv.size() == 2) {
 
-            if (sv[0].type() == typeid(std::string_view)) {
-                setSym(any_cast<std::string_view>(sv[0]), sv[1]);
-                /* auto sym = std::string(any_cast<std::string_view>(sv[0])); */
+            if (sv[0].is<std::string_view>()) {
+                setSym(value_cast<std::string_view>(sv[0]), sv[1]);
+                /* auto sym = std::string(value_cast<std::string_view>(sv[0])); */
                 /* if (sym[0] == '.') { */
                 /*     sym = std::string(lastLabel) + sym; */
                 /* } */
@@ -598,18 +1199,19 @@ void Assembler::setupRules()
                 /* } */
                 /* syms.set(sym, sv[1]); */
             } else {
-                auto args = any_cast<std::vector<std::string_view>>(sv[0]);
+                auto args = value_cast<std::vector<std::string_view>>(sv[0]);
                 fmt::print("ARGS {}\n", args.size());
-                std::any vec = sv[1];
+                Value vec = sv[1];
                 size_t i = 0;
-                if (auto const* v8 = any_cast<std::vector<uint8_t>>(&vec)) {
+                if (auto const* v8 = value_cast<Bytes>(&vec)) {
                     for(auto&& sym : args) {
                         auto v = i < v8->size() ? (*v8)[i] : 0;
                         syms.set(sym, v);
                         i++;
                     }
                 }
-                else if (auto const* vn = any_cast<std::vector<Number>>(&vec)) {
+                else if (auto const* vn =
+                             value_cast<Numbers>(&vec)) {
                     for(auto&& sym : args) {
                         auto v = i < vn->size() ? (*vn)[i] : 0;
                         setSym(sym, v);
@@ -627,67 +1229,68 @@ void Assembler::setupRules()
     });
 
     parser.after("DotSymbol",
-                 [&](SV& sv) -> std::any { return sv.token_view(); });
-    parser.after("AsmSymbol", [&](SV& sv) -> std::any {
+                 [&](SV& sv) -> Value { return sv.token_view(); });
+    parser.after("AsmSymbol", [&](SV& sv) -> Value {
         if (sv.size() == 2) {
             // Indexed symbol
             auto n = number<int32_t>(sv[1]);
-            auto s = any_cast<std::string_view>(sv[0]);
+            auto s = value_cast<std::string_view>(sv[0]);
             return std::make_pair(s, n);
         }
         return sv.token_view();
     });
 
-    parser.after("Label", [this](SV& sv) -> std::any {
+    parser.after("Label", [this](SV& sv) -> Value {
         handleLabel(sv[0]);
         return {};
     });
 
     parser.after("FnDef", [&](SV& sv) {
-        auto name = any_cast<std::string_view>(sv[0]);
-        auto args = any_cast<std::vector<std::string_view>>(sv[1]);
+        auto name = value_cast<std::string_view>(sv[0]);
+        auto args = value_cast<std::vector<std::string_view>>(sv[1]);
         return Def{name, args};
     });
 
     parser.after("MetaName", [&](SV& sv) { return sv[0]; });
 
-    parser.after("GenericDecl", [&](SV& sv) -> std::any {
+    parser.after("GenericDecl", [&](SV& sv) -> Value {
         Meta meta;
         meta.text = sv.token_view();
-        meta.name = any_cast<std::string_view>(sv[0]);
-        meta.args = any_cast<std::vector<std::any>>(sv[1]);
+        meta.name = value_cast<std::string_view>(sv[0]);
+        meta.args = value_cast<std::vector<Value>>(sv[1]);
         meta.line = sv.line();
         return meta;
     });
 
-    parser.after("IfBlock", [&](SV& sv) -> std::any {
+    parser.after("IfBlock", [&](SV& sv) -> Value {
         Meta meta;
-        meta.args.emplace_back(any_cast<Number>(sv[0]));
+        meta.args.emplace_back(value_cast<Number>(sv[0]));
         for (size_t i = 1; i < sv.size(); i++) {
-            meta.blocks.push_back(std::any_cast<Block>(sv[i]));
+            meta.blocks.push_back(value_cast<Block>(sv[i]));
         }
         meta.name = "if";
         meta.line = sv.line();
         return meta;
     });
 
-    parser.after("IfDefDecl", [this](SV& sv) -> std::any {
+    // Arguments of macros, lambdas and !rept count as defined
+    parser.after("IfDefDecl", [this](SV& sv) -> Value {
         ::Check(sv.size() >= 1, "Invalid !ifdef declaration");
-        auto s = any_cast<std::string_view>(sv[0]);
-        return Number(syms.is_defined(s));
+        auto s = value_cast<std::string_view>(sv[0]);
+        return Number(findBound(s) != nullptr || syms.is_defined(s));
     });
 
-    parser.after("IfNDefDecl", [this](SV& sv) -> std::any {
+    parser.after("IfNDefDecl", [this](SV& sv) -> Value {
         ::Check(sv.size() >= 1, "Invalid !ifndef declaration");
-        auto s = any_cast<std::string_view>(sv[0]);
-        return Number(!syms.is_defined(s));
+        auto s = value_cast<std::string_view>(sv[0]);
+        return Number(!(findBound(s) != nullptr || syms.is_defined(s)));
     });
 
-    parser.after("CheckDecl", [&](SV& sv) -> std::any {
+    parser.after("CheckDecl", [&](SV& sv) -> Value {
         ::Check(sv.size() >= 1, "Invalid !check declaration");
         Meta meta;
         meta.name = "check";
-        meta.blocks.push_back(any_cast<Block>(sv[0]));
+        meta.blocks.push_back(value_cast<Block>(sv[0]));
         meta.line = sv.line();
         return meta;
     });
@@ -696,14 +1299,14 @@ void Assembler::setupRules()
         return false; // Dont descend into children
     });
 
-    parser.after("DelayedExpression", [&](SV& sv) -> std::any {
+    parser.after("DelayedExpression", [&](SV& sv) -> Value {
         // Save child 'Expression' node for later evaluation
         return Block{sv.token_view(), sv.line(), get_child(sv.get_node(), 0)};
     });
 
-    parser.after("MacroDecl", [&](SV& sv) -> std::any {
+    parser.after("MacroDecl", [&](SV& sv) -> Value {
         ::Check(sv.size() >= 1, "Invalid !macro declaration");
-        auto fndef = any_cast<Def>(sv[0]);
+        auto fndef = value_cast<Def>(sv[0]);
         Meta meta;
 
         meta.name = "macro";
@@ -722,14 +1325,14 @@ void Assembler::setupRules()
             // Skip label
             i++;
         }
-        auto meta = any_cast<Meta>(sv[i++]);
+        auto meta = value_cast<Meta>(sv[i++]);
         while (i < sv.size()) {
-            if (sv[i].type() == typeid(Block)) {
-                auto block = any_cast<Block>(sv[i]);
+            if (sv[i].is<Block>()) {
+                auto block = value_cast<Block>(sv[i]);
                 meta.blocks.push_back(block);
-            } else if (sv[i].type() == typeid(std::string_view)) {
+            } else if (sv[i].is<std::string_view>()) {
                 meta.blocks.push_back(
-                    {any_cast<std::string_view>(sv[i]), sv.line(), nullptr});
+                    {value_cast<std::string_view>(sv[i]), sv.line(), nullptr});
             }
             i++;
         }
@@ -760,58 +1363,79 @@ void Assembler::setupRules()
 
     parser.after("FnCall", [this](SV& sv) {
         ::Check(sv.size() >= 1, "Invalid function call");
-        auto call = any_cast<Call>(sv[0]);
-        auto name = std::string(call.name);
-        bool found = false;
-
-        if (auto sym = syms.get_sym(name)) {
-            if (auto const* macro = std::any_cast<Macro>(&sym->value)) {
-                return applyDefine(*macro, call);
+        // Lambdas may evaluate this node again, so keep our own reference
+        Value const callValue = sv[0];
+        auto const& call = value_cast<Call>(callValue);
+
+        // Lambdas passed as arguments. They differ between calls, so the
+        // result can not be folded even if a pure function has the name.
+        if (auto const* bound = findBound(call.name)) {
+            if (auto const* fn = value_cast<Macro>(bound)) {
+                parser.noFold();
+                return applyDefine(*fn, call);
             }
-            found = true;
         }
 
-        auto it = functions.find(name);
-        if (it != functions.end()) {
-            try {
-                return (it->second)(call.args);
-            } catch (std::bad_any_cast&) {
-                return std::any{};
-            }
+        auto& cached = callSites[sv.get_node()];
+        if (cached.version != syms.version) {
+            resolvedCalls++;
+            cached = resolveCall(call.name);
         }
+        auto const site = cached;
 
-        if (scripting.hasFunction(call.name)) {
+        switch (site.kind) {
+        case CallSite::LAMBDA:
+            return applyDefine(value_cast<Macro>(site.lambda), call);
+        case CallSite::FUNCTION:
+            try {
+                if (site.pure) {
+                    auto& memo = memos[sv.get_node()];
+                    memo.pure = true;
+                    return memoized(memo, call.args, [&] {
+                        return (*site.function)(call.args);
+                    });
+                }
+                return (*site.function)(call.args);
+            } catch (bad_value_cast&) {
+                return Value{};
+            }
+        case CallSite::SCRIPT:
             return scripting.call(call.name, call.args);
         }
-
-        if (found) {
-            throw parse_error(fmt::format("'{}' is not callable", name));
-        }
-
-        throw parse_error(fmt::format("Unknown function '{}'", name));
+        return Value{};
     });
 
-    parser.after("Lambda", [&](SV& sv) -> std::any {
+    // A lambda node always gives the same value, so storing it again
+    // does not look like a redefinition
+    parser.after("Lambda", [&](SV& sv) -> Value {
         ::Check(sv.size() >= 2, "Invalid lambda expression");
-        auto args = any_cast<std::vector<std::string_view>>(sv[0]);
-        auto block = any_cast<Block>(sv[1]);
-        return Macro{"", args, block};
+        auto& lambda = lambdas[sv.get_node()];
+        if (!lambda.has_value()) {
+            auto args = value_cast<std::vector<std::string_view>>(sv[0]);
+            auto block = value_cast<Block>(sv[1]);
+            lambda = Macro{"", args, block};
+        }
+        return lambda;
     });
 
-    parser.after("Lambda2", [&](SV& sv) -> std::any {
+    parser.after("Lambda2", [&](SV& sv) -> Value {
         ::Check(sv.size() >= 1, "Invalid lambda expression");
-        auto block = any_cast<Block>(sv[0]);
-        return Macro{"", {}, block};
+        auto& lambda = lambdas[sv.get_node()];
+        if (!lambda.has_value()) {
+            auto block = value_cast<Block>(sv[0]);
+            lambda = Macro{"", {}, block};
+        }
+        return lambda;
     });
 
     parser.after("Call", [&](SV& sv) {
-        auto name = any_cast<std::string_view>(sv[0]);
-        auto args = any_cast<std::vector<std::any>>(sv[1]);
+        auto name = value_cast<std::string_view>(sv[0]);
+        auto args = value_cast<std::vector<Value>>(sv[1]);
         return Call{name, args};
     });
 
     parser.after("CallArgs", [&](SV& sv) {
-        std::vector<std::any> v;
+        std::vector<Value> v;
         v.reserve(sv.size());
         for (size_t i = 0; i < sv.size(); i++) {
             v.push_back(sv[i]);
@@ -823,8 +1447,8 @@ void Assembler::setupRules()
         if (sv.size() == 1) {
             return sv[0];
         }
-        return std::any(
-            std::make_pair(std::any_cast<std::string_view>(sv[0]), sv[1]));
+        return Value(
+            std::make_pair(value_cast<std::string_view>(sv[0]), sv[1]));
     });
 
     parser.after("ScriptContents", [&](SV& sv) { return sv.token_view(); });
@@ -836,7 +1460,7 @@ void Assembler::setupRules()
         std::vector<std::string_view> parts;
         parts.reserve(sv.size());
         for (size_t i = 0; i < sv.size(); i++) {
-            parts.emplace_back(any_cast<std::string_view>(sv[i]));
+            parts.emplace_back(value_cast<std::string_view>(sv[i]));
         }
         return parts;
     });
@@ -844,50 +1468,50 @@ void Assembler::setupRules()
         std::vector<std::string_view> parts;
         parts.reserve(sv.size());
         for (size_t i = 0; i < sv.size(); i++) {
-            parts.emplace_back(any_cast<std::string_view>(sv[i]));
+            parts.emplace_back(value_cast<std::string_view>(sv[i]));
         }
         return parts;
     });
 
     parser.before("BlockProgram", [&](SV&) { return false; });
 
-    parser.after("BlockProgram", [&](SV& sv) -> std::any {
+    parser.after("BlockProgram", [&](SV& sv) -> Value {
         return Block{sv.token_view(), sv.line(), get_child(sv.get_node(), 0)};
     });
 
-    parser.after("EnumLine", [this](SV& sv) -> std::any {
+    parser.after("EnumLine", [this](SV& sv) -> Value {
         if (sv.size() == 0) {
             // Empty line
             return {};
         }
-        auto sym = any_cast<std::string_view>(sv[0]);
+        auto sym = value_cast<std::string_view>(sv[0]);
         Number value = nextEnumValue;
 
         if (sv.size() > 1) {
-            value = any_cast<Number>(sv[1]);
+            value = value_cast<Number>(sv[1]);
         }
         nextEnumValue = value + 1;
         return std::pair(sym, value);
     });
 
-    parser.after("EnumBlock", [this](SV& sv) -> std::any {
+    parser.after("EnumBlock", [this](SV& sv) -> Value {
         AnyMap m;
         nextEnumValue = 0;
         if (!sv[0].has_value()) {
             for (size_t i = 1; i < sv.size(); i++) {
                 if (sv[i].has_value()) {
                     auto const& [name, value] =
-                        any_cast<std::pair<std::string_view, Number>>(sv[i]);
+                        value_cast<std::pair<std::string_view, Number>>(sv[i]);
                     syms[name] = value;
                 }
             }
             return Meta{};
         }
-        auto sym = any_cast<std::string_view>(sv[0]);
+        auto sym = value_cast<std::string_view>(sv[0]);
         for (size_t i = 1; i < sv.size(); i++) {
             if (sv[i].has_value()) {
                 auto const& [name, value] =
-                    any_cast<std::pair<std::string_view, Number>>(sv[i]);
+                    value_cast<std::pair<std::string_view, Number>>(sv[i]);
                 m[std::string(name)] = value;
             }
         }
@@ -899,9 +1523,9 @@ void Assembler::setupRules()
 
     parser.after("Opcode", [&](SV& sv) {
         std::string_view suffix;
-        auto name = any_cast<std::string_view>(sv[0]);
+        auto name = value_cast<std::string_view>(sv[0]);
         if (sv.size() == 2) {
-            suffix = any_cast<std::string_view>(sv[1]);
+            suffix = value_cast<std::string_view>(sv[1]);
         }
         return std::pair(name, suffix);
     });
@@ -909,8 +1533,8 @@ void Assembler::setupRules()
 
     parser.after("OpLine", [this](SV& sv) {
         for (size_t n = 0; n < sv.size(); n++) {
-            auto arg = sv[n];
-            if (auto* i = any_cast<Instruction>(&arg)) {
+            auto const arg = sv[n];
+            if (auto const* i = value_cast<Instruction>(&arg)) {
                 auto it = macros.find(i->opcode);
                 if (it != macros.end()) {
                     LOGD("Found macro %s", it->second.name);
@@ -922,7 +1546,7 @@ void Assembler::setupRules()
                     if ((sz == 0 && c.args.empty()) ||
                         (sz == 1 && c.args.size() == 1)) {
                         applyMacro(c);
-                        return std::any();
+                        return Value();
                     }
                 }
 
@@ -935,27 +1559,27 @@ void Assembler::setupRules()
                     throw parse_error(
                         fmt::format("Illegal instruction '{}'", i->opcode));
                 }
-            } else if (auto* c = any_cast<Call>(&arg)) {
+            } else if (auto const* c = value_cast<Call>(&arg)) {
                 applyMacro(*c);
             }
         }
-        return std::any();
+        return Value();
     });
 
     parser.after("Instruction", [&](SV& sv) {
         auto [opcode, suffix] =
-            any_cast<std::pair<std::string_view, std::string_view>>(sv[0]);
+            value_cast<std::pair<std::string_view, std::string_view>>(sv[0]);
         // opcode = utils::toLower(opcode);
         Instruction instruction{opcode, Mode::NONE, 0};
         if (sv.size() > 1) {
-            auto arg = any_cast<Instruction>(sv[1]);
+            auto arg = value_cast<Instruction>(sv[1]);
             if (arg.mode == sixfive::Mode::ABS && suffix == ".b") {
                 arg.mode = sixfive::Mode::ZP;
             }
             instruction.mode = arg.mode;
             instruction.val = arg.val;
         }
-        return std::any(instruction);
+        return Value(instruction);
     });
 
     // Set up the 'Instruction' parsing rules
@@ -964,10 +1588,15 @@ void Assembler::setupRules()
         {"Ind", Mode::IND}, {"IndX", Mode::INDX}, {"IndY", Mode::INDY},
         {"Acc", Mode::ACC}, {"Imm", Mode::IMM},
     };
-    auto buildArg = [](SV& sv) -> std::any {
-        auto mode = modeMap.at(std::string(sv.name()));
+    // Addressing mode for each rule ID
+    std::vector<Mode> ruleModes(parser.ruleCount(), Mode::NONE);
+    for (auto const& [name, mode] : modeMap) {
+        ruleModes[parser.ruleId(name)] = mode;
+    }
+    auto buildArg = [ruleModes](SV& sv) -> Value {
+        auto mode = ruleModes[sv.rule()];
         return Instruction{"", mode,
-                           mode == Mode::ACC ? 0 : any_cast<Number>(sv[0])};
+                           mode == Mode::ACC ? 0 : value_cast<Number>(sv[0])};
     };
     for (auto const& [name, _] : modeMap) {
         parser.after(name.c_str(), buildArg);
@@ -993,7 +1622,7 @@ void Assembler::setupRules()
         return syms.get(l);
     });
 
-    parser.after("Decimal", [this](SV& sv) -> Number {
+    parser.after("Decimal", [this](SV& sv) -> Value {
         try {
             return to_number(sv.token_view());
         } catch (std::out_of_range&) {
@@ -1004,7 +1633,7 @@ void Assembler::setupRules()
         }
     });
 
-    parser.after("Octal", [this](SV& sv) -> Number {
+    parser.after("Octal", [this](SV& sv) -> Value {
         try {
             return to_number(sv.token_view(), Base::Octal, 2);
         } catch (std::out_of_range&) {
@@ -1015,7 +1644,7 @@ void Assembler::setupRules()
         }
     });
 
-    parser.after("Multi", [this](SV& sv) -> Number {
+    parser.after("Multi", [this](SV& sv) -> Value {
         try {
             return to_number(sv.token_view(), Base::Quad, 2);
         } catch (std::out_of_range&) {
@@ -1026,7 +1655,7 @@ void Assembler::setupRules()
         }
     });
 
-    parser.after("Binary", [this](SV& sv) -> Number {
+    parser.after("Binary", [this](SV& sv) -> Value {
         try {
             int skip = 1;
             if (sv.token_view()[0] == '0') skip++;
@@ -1050,7 +1679,7 @@ void Assembler::setupRules()
         return s[0];
     });
 
-    parser.after("HexNum", [this](SV& sv) -> Number {
+    parser.after("HexNum", [this](SV& sv) -> Value {
         try {
             int skip = 1;
             if (sv.token_view()[0] == '0') skip++;
@@ -1066,7 +1695,7 @@ void Assembler::setupRules()
     parser.after("ArrayLiteral", [](SV& sv) -> std::vector<Number> {
         std::vector<Number> v;
         for (size_t i = 0; i < sv.size(); i++) {
-            std::any const& a = sv[i];
+            Value const& a = sv[i];
             v.push_back(number(a));
         }
         return v;
@@ -1077,18 +1706,17 @@ void Assembler::setupRules()
     parser.after("Expression", [this](SV& sv) {
         if (sv.size() == 2) {
             // Tern
-            auto p = any_cast<std::pair<Block, Block>>(sv[1]);
+            auto p = value_cast<Ternary>(sv[1]);
             if (number(sv[0]) != 0) {
-                return parser.evaluate(p.first.node);
+                return parser.evaluate(p.ifTrue.node);
             }
-            return parser.evaluate(p.second.node);
+            return parser.evaluate(p.ifFalse.node);
         }
         return sv[0];
     });
 
-    parser.after("Tern", [&](SV& sv) -> std::any {
-        return std::make_pair(std::any_cast<Block>(sv[0]),
-                              std::any_cast<Block>(sv[1]));
+    parser.after("Tern", [&](SV& sv) -> Value {
+        return Ternary{value_cast<Block>(sv[0]), value_cast<Block>(sv[1])};
     });
 
     parser.after("Expression2", [this](SV& sv) {
@@ -1096,13 +1724,20 @@ void Assembler::setupRules()
             return sv[0];
         }
 
-        auto ope = any_cast<std::string_view>(sv[1]);
-        auto arg1 = to_variant(sv[0]);
-        auto arg2 = to_variant(sv[2]);
+        auto ope = value_cast<Operator>(sv[1]);
+        auto const* ia = value_cast<int64_t>(&sv[0]);
+        auto const* ib = value_cast<int64_t>(&sv[2]);
+        auto a = value_cast<Number>(&sv[0]);
+        auto b = value_cast<Number>(&sv[2]);
 
       try {
-          auto res = operation(ope, arg1, arg2);
-          return std::visit([&](auto&& r) { return std::any(r); }, res);
+          if (ia != nullptr && ib != nullptr) {
+              return integerKernels[static_cast<size_t>(ope)](*ia, *ib);
+          }
+          if (a && b) {
+              return Value(numberKernels[static_cast<size_t>(ope)](*a, *b));
+          }
+          return operation(ope, sv[0], sv[2], strings);
       } catch (std::out_of_range&) {
           if (isFinalPass()) {
               throw parse_error("Out of range");
@@ -1118,17 +1753,19 @@ void Assembler::setupRules()
 
     parser.after("Script", [this](SV& sv) {
         if (passNo == 0) {
-            scripting.add(std::any_cast<std::string_view>(sv[0]));
+            scripting.add(value_cast<std::string_view>(sv[0]));
         }
         return sv[0];
     });
 
-    parser.after("Index", [this](SV& sv) -> std::any {
+    parser.after("Index", [this](SV& sv) -> Value {
         if (sv.size() == 1) {
             return sv[0];
         }
-        std::any vec = sv[0];
-        if (any_cast<Number>(&vec) != nullptr) {
+        // Lambdas may evaluate this node again, so keep our own reference
+        // to the indexed value
+        Value const vec = sv[0];
+        if (vec.is<Number>()) {
             // Slicing undefined symbol, return 0
             return any_num(0);
         }
@@ -1144,15 +1781,15 @@ void Assembler::setupRules()
             if (sv.size() > 3 && sv[3].has_value()) {
                 b = number<int64_t>(sv[3]);
             }
-            if (auto const* v8 = any_cast<std::vector<uint8_t>>(&vec)) {
+            if (auto const* v8 = value_cast<Bytes>(&vec)) {
                 return slice(*v8, a, b);
             }
-            if (auto const* vn = any_cast<std::vector<Number>>(&vec)) {
+            if (auto const* vn = value_cast<Numbers>(&vec)) {
                 return slice(*vn, a, b);
             }
 
             // Slice lambda
-            if (auto const* macro = any_cast<Macro>(&vec)) {
+            if (auto const* macro = value_cast<Macro>(&vec)) {
                 std::vector<Number> result(b - a);
                 Call call;
                 call.args.resize(1);
@@ -1168,10 +1805,10 @@ void Assembler::setupRules()
         }
 
         auto i = number<int64_t>(sv[1]);
-        if (auto const* v8 = any_cast<std::vector<uint8_t>>(&vec)) {
+        if (auto const* v8 = value_cast<Bytes>(&vec)) {
             return index(*v8, i);
         }
-        if (auto const* vn = any_cast<std::vector<Number>>(&vec)) {
+        if (auto const* vn = value_cast<Numbers>(&vec)) {
             return index(*vn, i);
         }
         throw parse_error("Can not index non-array");
@@ -1180,40 +1817,62 @@ void Assembler::setupRules()
     parser.after("UnOp", [&](SV& sv) { return sv.token_view()[0]; });
     parser.after("UnOp2", [&](SV& sv) { return sv.token_view()[0]; });
 
-    parser.after("Unary", [&](SV& sv) -> Number {
-        auto ope = any_cast<char>(sv[0]);
-        auto num = number(sv[1]);
-        auto inum = number<int64_t>(num);
+    parser.after("Unary", [&](SV& sv) -> Value {
+        auto ope = value_cast<char>(sv[0]);
+        auto inum = number<int64_t>(sv[1]);
         switch (ope) {
         case '~':
-            return static_cast<Number>(~(inum)&0xffffffff);
+            return ~inum & 0xffffffff;
         case '-':
-            return -num;
+            if (sv[1].is<int64_t>() && inum != int64Min) {
+                return -inum;
+            }
+            return -number(sv[1]);
         case '!':
-            return static_cast<Number>(inum == 0);
+            return inum == 0;
         default:
             throw parse_error("Unknown unary operator");
         }
     });
-    parser.after("Unary2", [&](SV& sv) -> Number {
-        auto ope = any_cast<char>(sv[0]);
-        auto num = number(sv[1]);
-        auto inum = number<int64_t>(num);
+    parser.after("Unary2", [&](SV& sv) -> Value {
+        auto ope = value_cast<char>(sv[0]);
+        auto inum = number<int64_t>(sv[1]);
         switch (ope) {
         case '<':
-            return static_cast<Number>(inum & 0xff);
+            return inum & 0xff;
         case '>':
-            return static_cast<Number>(inum >> 8);
+            return inum >> 8;
         default:
             throw parse_error("Unknown unary operator");
         }
     });
 
-    parser.after("Operator", [&](SV& sv) { return sv.token_view(); });
+    parser.after("Operator",
+                 [&](SV& sv) { return to_operator(sv.token_view()); });
+
+    // Expressions without symbols, `*` or impure functions have the same
+    // value in every pass
+    for (auto const* rule :
+         {"Expression", "Expression2", "Tern", "DelayedExpression", "Atom",
+          "Operator", "Unary", "Unary2", "UnOp", "UnOp2", "Number", "HexNum",
+          "Binary", "Octal", "Multi", "Decimal", "Char", "String",
+          "StringContents", "ArrayLiteral", "Index", "Indexable", "IndexSep",
+          "Call", "CallName", "CallArgs", "CallArg", "Symbol"}) {
+        parser.pure(rule);
+    }
+    parser.pure("FnCall", [this](SV& sv) {
+        auto call = SemanticValues{get_child(sv.get_node(), 0)};
+        auto name = SemanticValues{get_child(call.get_node(), 0)};
+        return pureFunctions.count(name.token_view()) > 0;
+    });
+    parser.pure("Variable", [this](SV& sv) {
+        auto name = sv.token_view();
+        return name == "true" || name == "false" ||
+               constants.count(std::string(name)) > 0;
+    });
 
     parser.after("Variable", [this](SV& sv) {
-        std::any val;
-        std::string full;
+        Value val;
 
         if (sv.token_view() == "true") {
             return any_num(1);
@@ -1222,22 +1881,47 @@ void Assembler::setupRules()
             return any_num(0);
         }
 
+        // Arguments, and the fields of arguments that are maps
+        if (!frames.empty() && sv.token_view()[0] != '.') {
+            auto const* bound = findBound(value_cast<std::string_view>(sv[0]));
+            for (size_t i = 1; bound != nullptr && i < sv.size(); i++) {
+                auto const* map = value_cast<AnyMap>(bound);
+                if (map == nullptr) {
+                    bound = nullptr;
+                    break;
+                }
+                auto it = map->find(
+                    std::string(value_cast<std::string_view>(sv[i])));
+                bound = it != map->end() ? &it->second : nullptr;
+            }
+            if (bound != nullptr) {
+                parser.noFold();
+                return *bound;
+            }
+        }
+
+        Atom atom = 0;
         if (sv.token_view()[0] == '.') {
-            full = std::string(lastLabel) + sv.token_view();
+            atom = syms.atom(std::string(lastLabel) +
+                             std::string(sv.token_view()));
         } else {
-
-            std::vector<std::string_view> parts;
-            parts.reserve(sv.size());
-            for (size_t i = 0; i < sv.size(); i++) {
-                parts.emplace_back(any_cast<std::string_view>(sv[i]));
+            auto [it, added] = variables.try_emplace(sv.get_node());
+            if (added) {
+                std::vector<std::string_view> parts;
+                parts.reserve(sv.size());
+                for (size_t i = 0; i < sv.size(); i++) {
+                    parts.emplace_back(value_cast<std::string_view>(sv[i]));
+                }
+                it->second = syms.atom(
+                    utils::join(parts.begin(), parts.end(), "."));
             }
-            full = utils::join(parts.begin(), parts.end(), ".");
+            atom = it->second;
         }
 
-        val = syms.get(full);
+        val = syms.get(atom);
         // Set undefined numbers to PC, to increase likelihood of
         // correct code generation (fewer passes)
-        if (val.type() == typeid(Number) && !syms.is_defined(full)) {
+        if (val.is<Number>() && !syms.is_defined(atom)) {
             val = static_cast<Number>(mach->getPC());
         }
         return val;
@@ -1249,8 +1933,28 @@ std::vector<Error> Assembler::getErrors() const
     return errors;
 }
 
+// Kept values stay valid as long as the constants keep their values, and
+// no symbol hides a pure function
+bool Assembler::foldsValid() const
+{
+    for (auto const& [name, val] : constants) {
+        auto sym = syms.get_sym(name);
+        auto n = sym ? value_cast<Number>(&sym->value) : std::nullopt;
+        if (!n || *n != val) {
+            return false;
+        }
+    }
+    return std::none_of(pureFunctions.begin(), pureFunctions.end(),
+                        [&](auto name) { return syms.get_sym(name); });
+}
+
 bool Assembler::pass(AstNode const& ast)
 {
+    if (!foldsValid()) {
+        parser.resetFolds(false);
+        memos.clear();
+        memoizing = false;
+    }
     labelNum = 0;
     mach->clear();
     syms.clear();
@@ -1260,7 +1964,7 @@ bool Assembler::pass(AstNode const& ast)
     needsFinalPass = false;
     try {
         parser.evaluate(ast);
-    } catch (std::bad_any_cast&) {
+    } catch (bad_value_cast&) {
         Error error = parser.getError();
         error.message = "Data type error";
         errors.push_back(error);
@@ -1305,12 +2009,29 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
 
     fileName = fname;
 
+    // Later runs start with the symbols of the earlier ones
+    if (!haveConstants) {
+        syms.forAll([&](std::string const& name, Value const& val) {
+            if (auto n = value_cast<Number>(&val)) {
+                constants[name] = *n;
+            }
+        });
+        haveConstants = true;
+    }
+    parser.resetFolds();
+    memos.clear();
+    memoizing = true;
+
     fmt::print("* PARSING\n");
     auto ast = parser.parse(source, fname);
     if (!ast) {
         errors.push_back(parser.getError());
         return false;
     }
+    // Statements of edited files are reparsed faster one by one
+    if (!parser.is_incremental() && threads != 1) {
+        preloadIncludes(ast);
+    }
 
     syms.accept_undefined(true);
     while (true) {
@@ -1337,7 +2058,7 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
 
             syms.set(prefix + ".start", start);
             syms.set(prefix + ".end", end);
-            syms.set(prefix + ".data", s.data);
+            syms.set_bytes(prefix + ".data", s.data);
         }
 
         passNo++;
@@ -1395,7 +2116,7 @@ Machine& Assembler::getMachine()
 
 void Assembler::printSymbols()
 {
-    syms.forAll([](std::string const& name, std::any const& val) {
+    syms.forAll([](std::string const& name, Value const& val) {
         if (!utils::startsWith(name, "__"))
             fmt::print("{} == {}\n", name, any_to_string(val));
     });
@@ -1404,10 +2125,10 @@ void Assembler::printSymbols()
 void Assembler::writeSymbols(fs::path const& p)
 {
     auto f = createFile(p);
-    syms.forAll([&](std::string const& name, std::any const& val) {
+    syms.forAll([&](std::string const& name, Value const& val) {
         if (!utils::startsWith(name, "__") &&
             (name.find('.') == std::string::npos) &&
-            val.type() == typeid(Number))
+            val.is<Number>())
             fmt::print(f.filePointer(), "{} = {}\n", name, any_to_string(val));
     });
 }
@@ -1430,7 +2151,17 @@ void Assembler::addLog(std::string_view text, size_t line)
 void Assembler::addCheck(Block const& block, size_t line)
 {
     auto& action = actions[mach->getPC()];
-    action.emplace_back(EmuAction{line, Check{block}});
+    // Copying all of RAM is only needed when the check, or a function it
+    // calls, may read it
+    auto const variable = parser.ruleId("Variable");
+    auto const fnCall = parser.ruleId("FnCall");
+    bool ram = false;
+    for_all_nodes(block.node, [&](AstNode node) {
+        SemanticValues const sv{node};
+        ram = ram || sv.rule() == fnCall ||
+              (sv.rule() == variable && sv.token_view() == "RAM");
+    });
+    action.emplace_back(EmuAction{line, Check{block, ram}});
     getMachine().addIntercept(mach->getPC(), checkFunction);
 }
 
@@ -1449,6 +2180,24 @@ void Assembler::clear()
     macros.clear();
     errors.clear();
     passNo = 0;
+
+    // Free all ASTs, and everything that refers to them
+    callSites.clear();
+    lambdas.clear();
+    variables.clear();
+    memos.clear();
+    snippets.clear();
+    includes.clear();
+    stored_includes.clear();
+    // Strings may refer to the arena, or to sources that are gone
+    syms.erase_if([](Value const& val) {
+        return val.is<Macro>() || val.is<std::string_view>() ||
+               val.is<std::vector<std::string_view>>();
+    });
+    syms.reset_atoms();
+    strings.clear();
+    lastLabel = {};
+    parser.clear();
 }
 
 Assembler::MetaFn Assembler::getMetaFn(const std::string& name)
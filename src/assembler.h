@@ -7,14 +7,62 @@
 #include "any_callable.h"
 #include "symbol_table.h"
 
+#include <array>
+#include <initializer_list>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
 class Machine;
 
-using AsmValue = std::variant<Number, std::string_view, std::vector<uint8_t>, std::vector<Number>>;
+// Values seen by Lua, where a meta command's arguments are `args`
+using AsmValue = std::variant<Number, std::string_view, std::vector<uint8_t>,
+                              std::vector<Number>>;
+
+struct Block //NOLINT
+{
+    std::string_view contents;
+    size_t line;
+    AstNode node;
+};
+
+// The alternatives of a `?:` expression
+struct Ternary
+{
+    Block ifTrue;
+    Block ifFalse;
+};
+
+struct Macro
+{
+    std::string_view name;
+    std::vector<std::string_view> args;
+    Block contents;
+};
+
+struct Call
+{
+    std::string_view name;
+    std::vector<Value> args;
+};
+
+struct Meta
+{
+    std::string text;
+    std::string_view name;
+    std::vector<Value> args;
+    std::vector<AsmValue> vargs;
+    std::vector<Block> blocks;
+    size_t line = 0;
+};
+
+struct Def
+{
+    std::string_view name;
+    std::vector<std::string_view> args;
+};
 
 inline void Check(bool v, std::string const& txt)
 {
@@ -44,27 +92,13 @@ public:
         RegState regs;
     };
 
-    struct Block //NOLINT
-    {
-        std::string_view contents;
-        size_t line;
-        std::shared_ptr<peg::AstBase<BassNode>> node;
-    };
-
-    struct Macro
-    {
-        std::string_view name;
-        std::vector<std::string_view> args;
-        Block contents;
-    };
+    using Block = ::Block;
+    using Macro = ::Macro;
+    using Call = ::Call;
+    using Meta = ::Meta;
+    using Def = ::Def;
 
-    struct Call
-    {
-        std::string_view name;
-        std::vector<std::any> args;
-    };
-
-    void handleLabel(std::any const& lbl);
+    void handleLabel(Value const& lbl);
 
     void pushScope(std::string_view name);
     void popScope();
@@ -89,6 +123,8 @@ public:
     bool isFinalPass()
     {
         needsFinalPass = true;
+        passChecks++;
+        parser.noFold();
         return finalPass;
     }
     bool isFirstPass() const { return passNo == 0; }
@@ -96,19 +132,17 @@ public:
     void registerFunction(std::string const& name, FN const& fn)
     {
         functions[name] = fn;
+        callSites.clear();
+        memos.clear();
     }
 
-    void addScript(fs::path const& p) { scripting.load(p); }
-
-    struct Meta
+    // Calls of these functions with constant arguments are evaluated once
+    void setPure(std::initializer_list<std::string_view> names)
     {
-        std::string text;
-        std::string_view name;
-        std::vector<std::any> args;
-        std::vector<AsmValue> vargs;
-        std::vector<Block> blocks;
-        size_t line = 0;
-    };
+        pureFunctions.insert(names.begin(), names.end());
+    }
+
+    void addScript(fs::path const& p) { scripting.load(p); }
 
     using MetaFn = std::function<void(Meta const&)>;
 
@@ -118,12 +152,6 @@ public:
         metaFunctions[utils::toUpper(name)] = fn;
     }
 
-    struct Def
-    {
-        std::string_view name;
-        std::vector<std::string_view> args;
-    };
-
     void defineMacro(std::string_view name,
                      std::vector<std::string_view> const& args,
                      Block const& block);
@@ -151,11 +179,56 @@ public:
     void setLastLabel(std::string_view l) { lastLabel = l; }
     void setLastLabel(std::string const& l) { lastLabel = persist(l); }
 
-    std::any applyDefine(Macro const& fn, Call const& call);
+    // Keep a string until the assembler is cleared
+    std::string_view persist(std::string_view s) { return strings.persist(s); }
+    StringArena const& getStrings() const { return strings; }
+    // Number of times a function call was looked up again
+    size_t getResolvedCalls() const { return resolvedCalls; }
+
+    Value applyDefine(Macro const& fn, Call const& call);
+    std::vector<Number> evaluateTable(Macro const& fn, Value const& range);
+
+    // Binds `names` to `values` while it exists, for the arguments of a
+    // macro, lambda or !rept block. Variables look in the bound names,
+    // innermost first, before the symbol table.
+    class Bind
+    {
+    public:
+        Bind(Assembler& a, std::vector<std::string_view> const& names,
+             std::vector<Value> const& values)
+            : assem(a)
+        {
+            assem.frames.push_back({&names, &values});
+        }
+        ~Bind() { assem.frames.pop_back(); }
+        Bind(Bind const&) = delete;
+        Bind& operator=(Bind const&) = delete;
+
+    private:
+        Assembler& assem;
+    };
+    Value const* findBound(std::string_view name) const;
 
     void clear();
 
     void useCache(bool on);
+    void setCacheDir(std::string const& dir);
+    void setCacheSize(uint64_t bytes);
+    void useIncremental(bool on);
+    // Number of threads used for parsing, or 0 for one per CPU. With 1,
+    // everything is parsed on this thread, and included files when they
+    // are first used.
+    void setThreads(unsigned n)
+    {
+        threads = n;
+        parser.set_threads(n);
+    }
+    // Memoize all rules, to see which ones gain from it
+    void collectPackratStats();
+    std::vector<PackratInfo> packratStats() const;
+    // Count and time the matches and actions of all grammar rules
+    void profileGrammar();
+    std::vector<RuleProfile> grammarProfile() const;
 
     std::vector<std::pair<std::string, int>> const& getLines() const { return lines; }
 
@@ -169,17 +242,22 @@ private:
     }
 
     template <typename T>
-    std::any slice(std::vector<T> const& v, int64_t a, int64_t b);
+    Value slice(Buffer<T> const& v, int64_t a, int64_t b);
     template <typename T>
-    std::any index(std::vector<T> const& v, int64_t index);
+    Value index(Buffer<T> const& v, int64_t index);
 
-    void setSym(std::string_view sym, std::any val);
-    void setRegSymbols();
+    void setSym(std::string_view sym, Value const& val);
+    void setRegSymbols(bool ram);
 
     std::vector<Error> errors;
 
     bool passDebug = false;
     std::unordered_map<std::string, AnyCallable> functions;
+    std::unordered_set<std::string_view> pureFunctions;
+    // Numeric symbols defined before the first parse, like `Math.Pi` and
+    // `-D` definitions
+    std::unordered_map<std::string, Number> constants;
+    bool haveConstants = false;
     std::unordered_map<std::string, MetaFn> metaFunctions;
 
     enum
@@ -189,10 +267,63 @@ private:
         ERROR
     };
 
+    // What the function call at an AST node resolved to, valid while the
+    // symbol table keeps the same version
+    struct CallSite
+    {
+        enum
+        {
+            LAMBDA,
+            FUNCTION,
+            SCRIPT
+        } kind;
+        uint64_t version = 0;
+        Value lambda;
+        AnyCallable const* function = nullptr;
+        bool pure = false;
+    };
+    std::unordered_map<AstNode, CallSite> callSites;
+    size_t resolvedCalls = 0;
+
+    // The lambda defined at an AST node
+    std::unordered_map<AstNode, Value> lambdas;
+    CallSite resolveCall(std::string_view name);
+
+    // The symbol a (not label relative) variable refers to, by its node
+    std::unordered_map<AstNode, Atom> variables;
+
+    // Up to three number arguments; the first element holds their count,
+    // and which of them are not integers
+    using MemoKey = std::array<uint64_t, 4>;
+    struct MemoHash
+    {
+        size_t operator()(MemoKey const& key) const;
+    };
+    static bool memoKey(std::vector<Value> const& args, MemoKey& key);
+
+    // Results of a pure lambda, by its body node, or of a call of a pure
+    // function, by the call node. Kept between passes like folded values.
+    struct Memo
+    {
+        bool checked = false;
+        bool pure = false;
+        std::unordered_map<MemoKey, Value, MemoHash> results;
+    };
+    std::unordered_map<AstNode, Memo> memos;
+    bool memoizing = true;
+    // Counts isFinalPass() calls, which mark values that depend on the
+    // pass. Reading an argument is no such call, it only stops folding.
+    uint32_t passChecks = 0;
+    template <typename FN>
+    Value memoized(Memo& memo, std::vector<Value> const& args, FN const& fn);
+
     void applyMacro(Call const& call);
     int checkUndefined();
     bool pass(AstNode const& ast);
+    bool foldsValid() const;
     void setupRules();
+    std::vector<std::string_view> findIncludes(AstNode root) const;
+    void preloadIncludes(AstNode root);
 
     auto save() { return std::tuple(macros, syms, lastLabel); }
 
@@ -205,6 +336,7 @@ private:
     struct Check
     {
         Block expression;
+        bool ram = true;
     };
 
     struct Log
@@ -222,6 +354,8 @@ private:
 
     fs::path currentPath;
     std::unordered_map<std::string, Block> includes;
+    // ASTs of the code given to evaluateCode(), by its text
+    std::unordered_map<std::string, AstNode> snippets;
     std::deque<std::string> stored_includes;
     std::shared_ptr<Machine> mach;
     std::unordered_map<std::string_view, Macro> macros;
@@ -236,6 +370,9 @@ private:
     std::string fileName;
 
     Parser parser;
+    // Parsers for loading included files in parallel
+    std::vector<std::unique_ptr<Parser>> workers;
+    unsigned threads = 0;
 
     int labelNum = 0;
     int inMacro = 0;
@@ -251,7 +388,15 @@ private:
 
     std::deque<std::string_view> scopes;
 
+    struct Frame
+    {
+        std::vector<std::string_view> const* names;
+        std::vector<Value> const* values;
+    };
+    std::vector<Frame> frames;
+
     Number nextEnumValue = 0;
 
+    StringArena strings;
     Scripting scripting;
 };
@@ -3,7 +3,6 @@
 #include "6502.h"
 #include "symbol_table.h"
 
-#include <any>
 #include <coreutils/file.h>
 #include <memory>
 #include <string>
@@ -16,22 +15,34 @@ namespace fs = std::filesystem;
 
 // using Number = double;
 
-// Update string view so contents is stored persistently
-inline std::string const& persist(std::string_view& sv)
+// Strings created during an assembly, like the results of `str()` or of
+// adding two strings. Views of them stay valid until the arena is
+// cleared, and equal strings are only stored once.
+class StringArena
 {
-    static std::unordered_set<std::string> persisted;
-    auto const& res = *persisted.emplace(sv).first;
-    sv = res;
-    return res;
-}
+public:
+    std::string_view persist(std::string_view sv)
+    {
+        auto [it, added] = strings.emplace(sv);
+        if (added) {
+            total += it->size();
+        }
+        return *it;
+    }
 
-// Store string and return string_view to it
-inline std::string_view persist(std::string const& s)
-{
-    std::string_view sv(s);
-    persist(sv);
-    return sv;
-}
+    size_t size() const { return strings.size(); }
+    size_t bytes() const { return total; }
+
+    void clear()
+    {
+        strings.clear();
+        total = 0;
+    }
+
+private:
+    std::unordered_set<std::string> strings;
+    size_t total = 0;
+};
 
 inline utils::File createFile(fs::path const& p)
 {
@@ -101,18 +112,6 @@ struct Num
     explicit operator bool() const { return d != 0; }
 };
 
-inline std::string_view operator+(std::string_view sv, Num n)
-{
-    return persist(std::string(sv) + std::to_string(n.i()));
-}
-
-inline std::string_view operator+(std::string_view sv, std::string_view n)
-{
-    return persist(std::string(sv) + std::string(n));
-}
-
-using Number = double;
-
 inline Num div(Num a, Num b)
 {
     DBZ(b.i());
@@ -125,14 +124,19 @@ inline Num pow(Num a, Num b)
 }
 
 template <typename T>
-inline T number(std::any const& v)
+inline T number(Value const& v)
 {
-    return static_cast<T>(std::any_cast<Number>(v));
+    if constexpr (std::is_integral_v<T>) {
+        if (auto const* i = value_cast<int64_t>(&v)) {
+            return static_cast<T>(*i);
+        }
+    }
+    return static_cast<T>(value_cast<Number>(v));
 }
 
-inline Number number(std::any const& v)
+inline Number number(Value const& v)
 {
-    return std::any_cast<Number>(v);
+    return value_cast<Number>(v);
 }
 
 template <typename T>
@@ -142,7 +146,7 @@ inline Number num(T const& v)
 }
 
 template <typename T>
-inline std::any any_num(T const& v)
+inline Value any_num(T const& v)
 {
     return static_cast<Number>(v);
 }
@@ -158,16 +162,6 @@ private:
     std::string msg;
 };
 
-struct Instruction
-{
-    Instruction(std::string_view op, sixfive::Mode m, double v)
-        : opcode(op), mode(m), val(static_cast<int32_t>(v))
-    {}
-    std::string_view opcode;
-    sixfive::Mode mode;
-    int32_t val;
-};
-
 inline std::string getHomeDir()
 {
     std::string homeDir;
@@ -192,23 +186,23 @@ inline std::string getHomeDir()
     return homeDir;
 }
 
-std::string any_to_string(std::any const& val);
+std::string any_to_string(Value const& val);
 
-inline void printArg(std::any const& arg)
+inline void printArg(Value const& arg)
 {
-    if (auto const* l = std::any_cast<Number>(&arg)) {
+    if (auto l = value_cast<Number>(&arg)) {
         if (*l == trunc(*l)) {
             fmt::print("${:x}", static_cast<int32_t>(*l));
         } else {
             fmt::print("{}", *l);
         }
-    } else if (auto const* s = std::any_cast<std::string_view>(&arg)) {
+    } else if (auto const* s = value_cast<std::string_view>(&arg)) {
         fmt::print("{}", *s);
-    } else if (auto const* v = std::any_cast<std::vector<uint8_t>>(&arg)) {
+    } else if (auto const* v = value_cast<Bytes>(&arg)) {
         for (auto const& item : *v) {
             fmt::print("{:02x} ", item);
         }
-    } else if (auto const* nv = std::any_cast<std::vector<Number>>(&arg)) {
+    } else if (auto const* nv = value_cast<Numbers>(&arg)) {
         for (auto const& item : *nv) {
             fmt::print("{} ", item);
         }
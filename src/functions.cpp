@@ -7,9 +7,10 @@
 #include <coreutils/file.h>
 #include <lodepng.h>
 
-template <typename Out, typename In>
-std::vector<Out> convert_vector(std::vector<In> const& in)
+template <typename Out, typename C>
+std::vector<Out> convert_vector(C const& in)
 {
+    using In = typename C::value_type;
     std::vector<Out> out;
     std::transform(std::cbegin(in), std::cend(in), std::back_inserter(out),
                    [](In const& a) { return static_cast<Out>(a); });
@@ -22,8 +23,8 @@ Image to_image(AnyMap const& img)
     image.bpp = number<int32_t>(img.at("bpp"));
     image.width = number<int32_t>(img.at("width"));
     image.height = number<int32_t>(img.at("height"));
-    image.pixels = std::any_cast<std::vector<uint8_t>>(img.at("pixels"));
-    auto colors = std::any_cast<std::vector<Number>>(img.at("colors"));
+    image.pixels = value_cast<Bytes>(img.at("pixels")).vector();
+    auto colors = value_cast<Numbers>(img.at("colors"));
     image.colors = convert_vector<uint32_t>(colors);
     return image;
 }
@@ -50,7 +51,7 @@ void initFunctions(Assembler& a)
     // * Any arithmetic type, but they will always be converted to/from double
     // * `std::vector<uint8_t>` for binary data
     // * `AnyMap` for returning struct like things
-    // * `std::vector<std::any> const&` as single argument.
+    // * `std::vector<Value> const&` as single argument.
 
     a.registerFunction("log", [](double f) { return std::log(f); });
     a.registerFunction("exp", [](double f) { return std::exp(f); });
@@ -70,19 +71,26 @@ void initFunctions(Assembler& a)
     a.registerFunction("pow",
                        [](double a, double b) { return std::pow(a, b); });
     a.registerFunction("len",
-                       [](std::vector<uint8_t> const& v) { return v.size(); });
+                       [](Bytes const& v) { return v.size(); });
     a.registerFunction("floor", [](double a) { return std::floor(a); });
     a.registerFunction("ceil", [](double a) { return std::ceil(a); });
     a.registerFunction("round", [](double a) { return std::round(a); });
     a.registerFunction("trunc", [](double a) { return std::trunc(a); });
     a.registerFunction("abs", [](double a) { return std::abs(a); });
+    a.registerFunction("clamp", [](double a, double lo, double hi) {
+        return std::min(std::max(a, lo), hi);
+    });
+
+    a.setPure({"log", "exp", "sqrt", "sin", "cos", "tan", "asin", "acos",
+               "atan", "min", "max", "pow", "len", "floor", "ceil", "round",
+               "trunc", "abs", "clamp"});
 
     a.registerFunction(
         "random", []() { return static_cast<double>(std::rand()) / RAND_MAX; });
 
     a.registerFunction("compare",
-                       [](std::vector<uint8_t> const& v0,
-                          std::vector<uint8_t> const& v1) { return v0 == v1; });
+                       [](Bytes const& v0,
+                          Bytes const& v1) { return v0 == v1; });
 
     a.registerFunction("load", [&](std::string_view name) {
         auto p = fs::path(name);
@@ -97,16 +105,16 @@ void initFunctions(Assembler& a)
         }
     });
 
-    a.registerFunction("word", [](std::vector<uint8_t> const& data) {
+    a.registerFunction("word", [](Bytes const& data) {
         Check(data.size() >= 2, "Need at least 2 bytes");
         return data[0] | (data[1] << 8);
     });
-    a.registerFunction("big_word", [](std::vector<uint8_t> const& data) {
+    a.registerFunction("big_word", [](Bytes const& data) {
         Check(data.size() >= 2, "Need at least 2 bytes");
         return data[1] | (data[0] << 8);
     });
 
-    a.registerFunction("translate", [](std::vector<uint8_t> const& data) {
+    a.registerFunction("translate", [](Bytes const& data) {
         std::vector<uint8_t> res;
         res.reserve(data.size());
         for (auto d : data) {
@@ -121,7 +129,7 @@ void initFunctions(Assembler& a)
         return res;
     });
 
-    a.registerFunction("bytes", [](std::vector<std::any> const& args) {
+    a.registerFunction("bytes", [](std::vector<Value> const& args) {
         std::vector<uint8_t> res;
         res.reserve(args.size());
         for (auto const& a : args) {
@@ -130,27 +138,33 @@ void initFunctions(Assembler& a)
         return res;
     });
 
-    a.registerFunction("to_upper", [](std::string_view sv) {
+    a.registerFunction("to_upper", [&a](std::string_view sv) {
         auto s = std::string(sv);
         for (auto& c : s) {
             c = toupper(c);
         }
-        return persist(s);
+        return a.persist(s);
     });
 
-    a.registerFunction("to_lower", [](std::string_view sv) {
+    a.registerFunction("to_lower", [&a](std::string_view sv) {
         auto s = std::string(sv);
         for (auto& c : s) {
             c = tolower(c);
         }
-        return persist(s);
+        return a.persist(s);
+    });
+
+    a.registerFunction("str", [&a](double n) {
+        return a.persist(std::to_string(static_cast<int64_t>(n)));
     });
 
-    a.registerFunction("str", [](double n) {
-        auto s = std::to_string(static_cast<int64_t>(n));
-        std::string_view sv = s;
-        persist(sv);
-        return sv;
+    // `translate` depends on the current !encoding, so it is not pure
+    a.setPure({"compare", "word", "big_word", "zeroes", "bytes", "to_upper",
+               "to_lower", "str"});
+
+    a.registerFunction("table", [&](std::vector<Value> const& args) {
+        Check(args.size() == 2, "table() needs a range and a lambda");
+        return a.evaluateTable(value_cast<Macro>(args[1]), args[0]);
     });
 
     a.registerFunction("index_tiles",
@@ -226,7 +240,7 @@ void initFunctions(Assembler& a)
 
     // TODO: Remove
     a.registerFunction("to_monochrome",
-                       [&](std::vector<uint8_t> const& pixels) {
+                       [&](Bytes const& pixels) {
                            std::vector<uint8_t> result(pixels.size() / 8);
                            uint8_t* out = result.data();
                            int32_t v = 0;
@@ -242,4 +256,8 @@ void initFunctions(Assembler& a)
                            }
                            return result;
                        });
+
+    a.setPure({"index_tiles", "layout_tiles", "layout_image",
+               "convert_palette", "change_bpp", "remap_image",
+               "to_monochrome"});
 }
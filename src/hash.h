@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+using Hash128 = std::array<uint8_t, 16>;
+
+// MurmurHash3 (x64, 128 bit variant). A fast, non cryptographic hash,
+// used to identify cached data.
+inline Hash128 hash128(void const* data, size_t size, uint64_t seed = 0)
+{
+    constexpr uint64_t c1 = 0x87c37b91114253d5ULL;
+    constexpr uint64_t c2 = 0x4cf5ad432745937fULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto fmix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+    auto mix1 = [&](uint64_t k) {
+        k *= c1;
+        k = rotl(k, 31);
+        return k * c2;
+    };
+    auto mix2 = [&](uint64_t k) {
+        k *= c2;
+        k = rotl(k, 33);
+        return k * c1;
+    };
+
+    auto const* p = static_cast<uint8_t const*>(data);
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    size_t const blocks = size / 16;
+    for (size_t i = 0; i < blocks; i++, p += 16) {
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+        h1 ^= mix1(k1);
+        h1 = rotl(h1, 27) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+        h2 ^= mix2(k2);
+        h2 = rotl(h2, 31) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // Remaining bytes, zero padded to a full block
+    auto rest = size & 15;
+    if (rest > 0) {
+        std::array<uint8_t, 16> tail{};
+        memcpy(tail.data(), p, rest);
+        memcpy(&k1, tail.data(), 8);
+        memcpy(&k2, tail.data() + 8, 8);
+        if (rest > 8) {
+            h2 ^= mix2(k2);
+        }
+        h1 ^= mix1(k1);
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    Hash128 result;
+    memcpy(result.data(), &h1, 8);
+    memcpy(result.data() + 8, &h2, 8);
+    return result;
+}
@@ -51,6 +51,12 @@ struct AssemblerState
     OutFmt outFmt = OutFmt::Prg;
     bool compress = false;
     bool astCache = true;
+    bool packratStats = false;
+    bool stringStats = false;
+    bool profileGrammar = false;
+    std::string profileJson;
+    std::string cacheDir;
+    uint64_t cacheSize = 128;
     int32_t start = -1;
 
     void parseArgs(int argc, char** argv)
@@ -76,6 +82,18 @@ struct AssemblerState
         app.add_option("--org", start, "Set default start address");
         app.add_flag("-c,--compress", compress, "Compress program");
         app.add_flag("--no-cache", noCache, "Don't cache generated ASTs");
+        app.add_option("--cache-dir", cacheDir,
+                       "Directory for cached ASTs (default ~/.basscache)");
+        app.add_option("--cache-size", cacheSize,
+                       "Max size of AST cache in MB (default 128)");
+        app.add_flag("--packrat-stats", packratStats,
+                     "Memoize all grammar rules and show which ones gain");
+        app.add_flag("--string-stats", stringStats,
+                     "Show how many strings the assembly created");
+        app.add_flag("--profile-grammar", profileGrammar,
+                     "Show time spent in each grammar rule and its action");
+        app.add_option("--profile-json", profileJson,
+                       "Write grammar profile as JSON to file");
         app.add_flag("--no-screen", noScreen, "Don't use textmode graphics in emulator");
         app.add_flag("--trace-code", traceCode, "Trace executed assembly");
 
@@ -98,6 +116,9 @@ struct AssemblerState
         try {
             app.parse(argc, argv);
             astCache = !noCache;
+            if (!profileJson.empty()) {
+                profileGrammar = true;
+            }
             if (compress) {
                 outFmt = OutFmt::PackedPrg;
             }
@@ -121,7 +142,17 @@ struct AssemblerState
         assem.setDebugFlags((showUndef ? Assembler::DEB_PASS : 0) |
                             (showTrace ? Assembler::DEB_TRACE : 0));
 
-        assem.useCache(!doRun && astCache);
+        // Cached ASTs are not parsed, so there would be nothing to profile
+        assem.useCache(!doRun && astCache && !profileGrammar);
+        assem.setCacheDir(cacheDir);
+        assem.setCacheSize(cacheSize * 1024 * 1024);
+        assem.useIncremental(doRun);
+        if (packratStats) {
+            assem.collectPackratStats();
+        }
+        if (profileGrammar) {
+            assem.profileGrammar();
+        }
 
         if (outFile.empty()) {
             outFile =
@@ -180,6 +211,44 @@ struct AssemblerState
 //        }
         return !failed;
     }
+
+    void printProfile(Assembler const& assem) const
+    {
+        auto ms = [](int64_t ns) { return static_cast<double>(ns) / 1.0e6; };
+        auto profile = assem.grammarProfile();
+        if (!profileJson.empty()) {
+            utils::File f{profileJson, utils::File::Mode::Write};
+            f.writeString("[\n");
+            bool first = true;
+            for (auto const& r : profile) {
+                f.writeString(fmt::format(
+                    "{}  {{\"rule\": \"{}\", \"attempts\": {}, "
+                    "\"successes\": {}, \"backtracks\": {}, "
+                    "\"parse_ms\": {:.3f}, \"parse_self_ms\": {:.3f}, "
+                    "\"evaluations\": {}, \"action_ms\": {:.3f}, "
+                    "\"action_self_ms\": {:.3f}}}",
+                    first ? "" : ",\n", r.rule, r.attempts, r.successes,
+                    r.backtracks, ms(r.parseTime), ms(r.parseSelf),
+                    r.evaluations, ms(r.actionTime), ms(r.actionSelf)));
+                first = false;
+            }
+            f.writeString("\n]\n");
+            return;
+        }
+        fmt::print("{:<20} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9}\n",
+                   "Rule", "Attempts", "Matches", "Backtrack", "Parse ms",
+                   "Self ms", "Actions", "Action ms", "Self ms");
+        for (auto const& r : profile) {
+            if (r.attempts == 0 && r.evaluations == 0) {
+                continue;
+            }
+            fmt::print("{:<20} {:>9} {:>9} {:>9} {:>9.2f} {:>9.2f} {:>9} "
+                       "{:>9.2f} {:>9.2f}\n",
+                       r.rule, r.attempts, r.successes, r.backtracks,
+                       ms(r.parseTime), ms(r.parseSelf), r.evaluations,
+                       ms(r.actionTime), ms(r.actionSelf));
+        }
+    }
 };
 
 int main(int argc, char** argv)
@@ -272,7 +341,27 @@ int main(int argc, char** argv)
     }
 
     assem.clear();
-    if (!state.assemble(assem)) {
+    auto ok = state.assemble(assem);
+    if (state.packratStats) {
+        fmt::print("{:<24} {:>10} {:>10} {:>6}\n", "Rule", "Lookups", "Hits",
+                   "Hit%");
+        for (auto const& info : assem.packratStats()) {
+            if (info.lookups > 0) {
+                fmt::print("{:<24} {:>10} {:>10} {:>6.1f}\n", info.rule,
+                           info.lookups, info.hits,
+                           100.0 * static_cast<double>(info.hits) /
+                               static_cast<double>(info.lookups));
+            }
+        }
+    }
+    if (state.stringStats) {
+        auto const& strings = assem.getStrings();
+        fmt::print("{} strings, {} bytes\n", strings.size(), strings.bytes());
+    }
+    if (state.profileGrammar) {
+        state.printProfile(assem);
+    }
+    if (!ok) {
         return 1;
     }
 
@@ -6,7 +6,6 @@
 #include <lib.h>
 #include <shrink_inmem.h>
 
-#include <any>
 #include <coreutils/file.h>
 #include <coreutils/log.h>
 #include <coreutils/split.h>
@@ -18,7 +17,7 @@ using namespace std::string_literals;
 
 namespace {
 
-Section parseArgs(std::vector<std::any> const& args)
+Section parseArgs(std::vector<Value> const& args)
 {
     Section result;
     int i = 0;
@@ -28,15 +27,15 @@ Section parseArgs(std::vector<std::any> const& args)
     }
     for (auto const& arg : args) {
         if (auto const* p =
-                std::any_cast<std::pair<std::string_view, std::any>>(&arg)) {
+                value_cast<std::pair<std::string_view, Value>>(&arg)) {
             if (p->first == "name") {
-                result.name = std::any_cast<std::string_view>(p->second);
+                result.name = value_cast<std::string_view>(p->second);
             } else if (p->first == "start") {
                 result.start = number<int32_t>(p->second);
             } else if (p->first == "size") {
                 result.size = number<int32_t>(p->second);
             } else if (p->first == "in") {
-                result.parent = std::any_cast<std::string_view>(p->second);
+                result.parent = value_cast<std::string_view>(p->second);
             } else if (p->first == "pc") {
                 result.pc = number<int32_t>(p->second);
             } else if (p->first == "NoStore") {
@@ -50,7 +49,7 @@ Section parseArgs(std::vector<std::any> const& args)
             }
         } else {
             if (i == 0) {
-                result.name = std::any_cast<std::string_view>(arg);
+                result.name = value_cast<std::string_view>(arg);
             } else if (i == 1) {
                 result.start = number<uint32_t>(arg);
             } else if (i == 2) {
@@ -88,13 +87,13 @@ static auto strip_space = [](std::string_view sv) -> std::string_view {
 void metaText(Assembler::Meta const& meta, Machine& mach)
 {
     for (auto const& v : meta.args) {
-        if (auto const* s = std::any_cast<std::string_view>(&v)) {
+        if (auto const* s = value_cast<std::string_view>(&v)) {
             auto ws = utils::utf8_decode(*s);
             for (auto c : ws) {
                 auto b = translateChar(c);
                 mach.writeChar(b);
             }
-        } else if (auto const* n = std::any_cast<Number>(&v)) {
+        } else if (auto n = value_cast<Number>(&v)) {
             mach.writeByte(*n);
         } else {
             throw parse_error("Need text");
@@ -124,7 +123,6 @@ extern Translation currentTranslation;
 
 void initMeta(Assembler& assem)
 {
-    using std::any_cast;
     using Meta = Assembler::Meta;
     static bool globalCond = true;
     auto& mach = assem.getMachine();
@@ -134,29 +132,29 @@ void initMeta(Assembler& assem)
     assem.registerMeta("rept", [&](Meta const& meta) {
         Check(meta.blocks.size() == 1, "Expected block");
         Check(meta.args.size() == 1, "Expected single argument");
-        std::any data = meta.args[0];
-        std::string indexVar = "i";
-        std::vector<uint8_t>* vec = nullptr;
+        Value data = meta.args[0];
+        std::string_view indexVar = "i";
+        Bytes const* vec = nullptr;
         size_t count = 0;
-        if (auto* p = any_cast<std::pair<std::string_view, std::any>>(&data)) {
+        if (auto* p = value_cast<std::pair<std::string_view, Value>>(&data)) {
             indexVar = p->first;
             count = number<size_t>(p->second);
-        } else if ((vec = any_cast<std::vector<uint8_t>>(&data))) {
+        } else if ((vec = value_cast<Bytes>(&data))) {
             count = vec->size();
         } else {
             count = number<size_t>(data);
         }
         auto ll = assem.getLastLabel();
-        assem.getSymbols().erase(indexVar);
+        std::vector<std::string_view> names{indexVar, "v"};
+        std::vector<Value> values(vec != nullptr ? 2 : 1);
+        Assembler::Bind const bind{assem, names, values};
         for (size_t i = 0; i < count; i++) {
-            assem.getSymbols().set(indexVar, any_num(i));
+            values[0] = any_num(i);
             if (vec != nullptr) {
-                assem.getSymbols().erase("v");
-                assem.getSymbols().set("v", any_num((*vec)[i]));
+                values[1] = any_num((*vec)[i]);
             }
             //assem.setLastLabel("__rept" + std::to_string(mach.getPC()));
             assem.evaluateBlock(meta.blocks[0]);
-            assem.getSymbols().erase(indexVar);
         }
         assem.setLastLabel(ll);
     });
@@ -167,12 +165,12 @@ void initMeta(Assembler& assem)
         using sixfive::Reg;
         RegState regs;
         for (auto const& v : meta.args) {
-            if (auto const* s = any_cast<std::string_view>(&v)) {
+            if (auto const* s = value_cast<std::string_view>(&v)) {
                 testName = *s;
-            } else if (auto const* n = any_cast<Number>(&v)) {
+            } else if (auto n = value_cast<Number>(&v)) {
                 start = static_cast<uint32_t>(*n);
             } else if (auto const* p =
-                           std::any_cast<std::pair<std::string_view, std::any>>(
+                           value_cast<std::pair<std::string_view, Value>>(
                                &v)) {
                 if (p->first == "A") {
                     regs.regs[0] = number<unsigned>(p->second);
@@ -194,8 +192,9 @@ void initMeta(Assembler& assem)
     assem.registerMeta("macro", [&](Meta const& meta) {
         Check(!meta.blocks.empty(), "Expected block");
 
-        auto macroName = any_cast<std::string_view>(meta.args[0]);
-        auto macroArgs = any_cast<std::vector<std::string_view>>(meta.args[1]);
+        auto macroName = value_cast<std::string_view>(meta.args[0]);
+        auto macroArgs =
+            value_cast<std::vector<std::string_view>>(meta.args[1]);
 
         assem.defineMacro(macroName, macroArgs, meta.blocks[0]);
     });
@@ -204,7 +203,7 @@ void initMeta(Assembler& assem)
         "ascii", [&](Meta const&) { setTranslation(Translation::Ascii); });
 
     assem.registerMeta("encoding", [&](Meta const& meta) {
-        auto name = any_cast<std::string_view>(meta.args[0]);
+        auto name = value_cast<std::string_view>(meta.args[0]);
 
         setTranslation(name);
     });
@@ -213,7 +212,7 @@ void initMeta(Assembler& assem)
         std::u32string text;
         size_t index = 0;
         for (auto const& v : meta.args) {
-            if (auto const* s = any_cast<std::string_view>(&v)) {
+            if (auto const* s = value_cast<std::string_view>(&v)) {
                 text = utils::utf8_decode(*s);
                 index = 0;
             } else {
@@ -249,7 +248,7 @@ void initMeta(Assembler& assem)
 
     assem.registerMeta("byte", [&](Meta const& meta) {
         for (auto const& v : meta.args) {
-            if (auto const* s = any_cast<std::string_view>(&v)) {
+            if (auto const* s = value_cast<std::string_view>(&v)) {
                 for (auto c : *s) {
                     mach.writeChar(c);
                 }
@@ -279,11 +278,11 @@ void initMeta(Assembler& assem)
 
     assem.registerMeta("assert", [&](Meta const& meta) {
         if (!assem.isFinalPass()) return;
-        auto v = any_cast<Number>(meta.args[0]);
+        auto v = value_cast<Number>(meta.args[0]);
         if (v == 0.0) {
             std::string_view msg = meta.text;
             if (meta.args.size() > 1) {
-                msg = any_cast<std::string_view>(meta.args[1]);
+                msg = value_cast<std::string_view>(meta.args[1]);
             }
             throw assert_error(std::string(msg));
         }
@@ -329,7 +328,7 @@ void initMeta(Assembler& assem)
     });
 
     assem.registerMeta("cpu", [&](Meta const& meta) {
-        auto text = any_cast<std::string_view>(meta.args[0]);
+        auto text = value_cast<std::string_view>(meta.args[0]);
         if (text == "6502") {
             mach.setCpu(Machine::CPU_6502);
         } else if (text == "65C02") {
@@ -376,7 +375,7 @@ void initMeta(Assembler& assem)
     });
 
     assem.registerMeta("log", [&](Meta const& meta) {
-        auto text = any_cast<std::string_view>(meta.args[0]);
+        auto text = value_cast<std::string_view>(meta.args[0]);
         assem.addLog(text, meta.line);
     });
 
@@ -444,7 +443,7 @@ void initMeta(Assembler& assem)
                 syms.set(p + ".original_size", section.data.size());
                 section.data = packed;
             }
-            syms.set(p + ".data", section.data);
+            syms.set_bytes(p + ".data", section.data);
             syms.set(p + ".start", section.start);
             syms.set(p + ".pc", pc);
             syms.set(p + ".size", section.data.size());
@@ -462,16 +461,16 @@ void initMeta(Assembler& assem)
 
         // Create source lambda depending on first argument
         std::function<Number(size_t)> src;
-        if (auto* vec = any_cast<std::vector<uint8_t>>(&data)) {
+        if (auto* vec = value_cast<Bytes>(&data)) {
             size = vec->size();
             src = [v = *vec](size_t i) -> Number { return v[i]; };
-        } else if (auto* nv = any_cast<std::vector<Number>>(&data)) {
+        } else if (auto* nv = value_cast<Numbers>(&data)) {
             size = nv->size();
             src = [v = *nv](size_t i) -> Number {
                 auto d = v[i];
                 return d;
             };
-        } else if (auto* sv = any_cast<std::string_view>(&data)) {
+        } else if (auto* sv = value_cast<std::string_view>(&data)) {
             LOGI("Fill string %s", *sv);
             auto utext = utils::utf8_decode(*sv);
             size = utext.size();
@@ -497,11 +496,11 @@ void initMeta(Assembler& assem)
             }
         } else {
             data = meta.args[1];
-            if (auto* val = any_cast<Number>(&data)) {
+            if (auto val = value_cast<Number>(&data)) {
                 auto n = static_cast<uint8_t>(*val);
                 tx = [n](size_t, Number) -> uint8_t { return n; };
             } else {
-                macro = any_cast<Assembler::Macro>(&data);
+                macro = value_cast<Assembler::Macro>(&data);
                 ::Check(macro != nullptr, "Invalid !fill macro");
                 call.args.resize(macro->args.size());
                 tx = [&](size_t i, Number n) -> uint8_t {
@@ -527,11 +526,45 @@ void initMeta(Assembler& assem)
         }
     });
 
+    assem.registerMeta("table", [&](Meta const& meta) {
+        ::Check(meta.args.size() == 2 || meta.args.size() == 3,
+                "Invalid !table meta command");
+        auto const* macro = value_cast<Assembler::Macro>(&meta.args[1]);
+        ::Check(macro != nullptr, "Invalid !table lambda");
+        std::string_view format = "bytes";
+        if (meta.args.size() == 3) {
+            format = value_cast<std::string_view>(meta.args[2]);
+        }
+
+        auto values = assem.evaluateTable(*macro, meta.args[0]);
+        auto writeBytes = [&](int shift) {
+            for (auto v : values) {
+                mach.writeByte((static_cast<int64_t>(v) >> shift) & 0xff);
+            }
+        };
+        if (format == "bytes" || format == "lo") {
+            writeBytes(0);
+        } else if (format == "hi") {
+            writeBytes(8);
+        } else if (format == "split") {
+            writeBytes(0);
+            writeBytes(8);
+        } else if (format == "words") {
+            for (auto v : values) {
+                auto w = static_cast<int64_t>(v);
+                mach.writeByte(w & 0xff);
+                mach.writeByte((w >> 8) & 0xff);
+            }
+        } else {
+            throw parse_error(fmt::format("Unknown table format '{}'", format));
+        }
+    });
+
     assem.registerMeta("include", [&](Meta const& meta) {
         Check(meta.args.size() == 1, "Incorrect number of arguments");
-        auto name = any_cast<std::string_view>(meta.args[0]);
+        auto name = value_cast<std::string_view>(meta.args[0]);
         auto fullPath = assem.evaluatePath(name);
-        auto fileName = persist(fullPath.string());
+        auto fileName = assem.persist(fullPath.string());
         auto block = assem.includeFile(fileName);
         auto saved = assem.getCurrentPath();
         assem.setCurrentPath(fullPath.parent_path());
@@ -542,7 +575,7 @@ void initMeta(Assembler& assem)
     assem.registerMeta("script", [&](Meta const& meta) {
         if (assem.isFirstPass()) {
             Check(meta.args.size() == 1, "Incorrect number of arguments");
-            auto name = any_cast<std::string_view>(meta.args[0]);
+            auto name = value_cast<std::string_view>(meta.args[0]);
             auto p = fs::path(name);
             if (p.is_relative()) {
                 p = assem.getCurrentPath() / p;
@@ -553,7 +586,7 @@ void initMeta(Assembler& assem)
 
     assem.registerMeta("incbin", [&](Meta const& meta) {
         Check(meta.args.size() == 1, "Incorrect number of arguments");
-        auto name = any_cast<std::string_view>(meta.args[0]);
+        auto name = value_cast<std::string_view>(meta.args[0]);
         auto p = fs::path(name);
         if (p.is_relative()) {
             p = assem.getCurrentPath() / p;
@@ -566,7 +599,7 @@ void initMeta(Assembler& assem)
 
     assem.registerMeta("enum", [&](Meta const& meta) {
         Check(!meta.blocks.empty(), "Expected block");
-        assem.pushScope(any_cast<std::string_view>(meta.args[0]));
+        assem.pushScope(value_cast<std::string_view>(meta.args[0]));
         assem.evaluateBlock(meta.blocks[0]);
         assem.popScope();
     });
@@ -1,52 +1,101 @@
 #include "parser.h"
 
 #include "defines.h"
+#include "hash.h"
 #include <peglib.h>
 
 #include <coreutils/log.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
+#include <random>
 #include <string>
+#include <thread>
+#include <tuple>
 
 using namespace std::string_literals;
 
+// Sources at least this large are split and parsed on several threads
+constexpr size_t ParallelParseSize = 64 * 1024;
+
+// Smaller sources are parsed again rather than kept in the disk cache
+constexpr size_t CacheParseSize = 4 * 1024;
+
+// One node of the flattened AST. Ops are stored in pre-order, so the
+// children of an op are the ops between it and `end`.
+struct AstOp
+{
+    BassNode* node;
+    uint32_t end;
+    uint32_t rule;
+};
+
 struct BassNode
 {
-    std::vector<std::any> v;
+    std::string_view name;
+    uint32_t rule;
+    uint32_t line;
+    uint32_t column;
+    uint32_t position;
+    uint32_t length;
     std::string_view source;
     std::string_view file_name;
-    ActionFn* action{};
+
+    BassNode** nodes;
+    uint32_t nodeCount;
+
+    // Values of evaluated children, one slot per child
+    Value* v;
+    uint32_t vcount;
+
+    // The subtree of this node is constant, and the kept value if this
+    // is its root
+    bool foldable;
+    bool foldRoot;
+    Value const* folded;
+
+    // The flattened tree this node belongs to, and its index in it
+    AstOp const* program;
+    uint32_t op;
 };
 
 AstNode get_child(AstNode node, size_t i)
 {
-    return node->nodes.size() > i ? node->nodes[i] : nullptr;
+    return node->nodeCount > i ? node->nodes[i] : nullptr;
 }
 
-SemanticValues::SemanticValues(AstNode const& a) : ast(a) {}
+void for_all_nodes(AstNode root, std::function<void(AstNode)> const& fn)
+{
+    auto const* program = root->program;
+    for (auto i = root->op; i < program[root->op].end; i++) {
+        fn(program[i].node);
+    }
+}
+
+SemanticValues::SemanticValues(BassNode* a) : ast(a) {}
 
 std::pair<size_t, size_t> SemanticValues::line_info() const
 {
     return {ast->line, ast->column};
 }
-std::any SemanticValues::operator[](size_t i) const
+Value const& SemanticValues::operator[](size_t i) const
 {
     return ast->v[i];
 }
 std::string_view SemanticValues::token_view() const
 {
-    if (!ast->is_token) {
-        return ast->source.substr(ast->position, ast->length);
-    }
-    return ast->token;
+    return ast->source.substr(ast->position, ast->length);
 }
 size_t SemanticValues::size() const
 {
-    return ast->v.size();
+    return ast->vcount;
 }
 
-std::string const& SemanticValues::file_name() const
+std::string_view SemanticValues::file_name() const
 {
-    return ast->path;
+    return ast->file_name;
 }
 
 std::string_view SemanticValues::name() const
@@ -54,17 +103,52 @@ std::string_view SemanticValues::name() const
     return ast->name;
 }
 
-Parser::Parser(const char* s) : p(std::make_unique<peg::parser>(s))
+size_t SemanticValues::rule() const
 {
-    if (useCache) {
-        SHA512(reinterpret_cast<const uint8_t*>(s), strlen(s),
-               grammarSHA.data());
-    }
+    return ast->rule;
+}
+
+Parser::Parser(const char* s)
+    : grammarText(s), p(std::make_unique<peg::parser>(s))
+{
+    grammarHash = hash128(s, strlen(s));
     if (!(*p)) {
         fprintf(stderr, "Error:: Illegal grammar\n");
         exit(0);
     }
-    p->enable_ast<peg::AstBase<BassNode>>();
+    p->get_rule_names(ruleNames);
+    for (size_t i = 0; i < ruleNames.size(); i++) {
+        ruleMap[ruleNames[i]] = i;
+    }
+    preActions.resize(ruleNames.size());
+    postActions.resize(ruleNames.size());
+    pureRules.resize(ruleNames.size());
+    pureChecks.resize(ruleNames.size());
+
+    // Build the AST directly into our arena
+    for (size_t i = 0; i < ruleNames.size(); i++) {
+        auto& rule = (*p)[ruleNames[i].data()];
+        if (rule.ignoreSemanticValue) {
+            continue;
+        }
+        rule.action = [this, i](peg::SemanticValues const& vs) -> std::any {
+            auto* node = arena.make<BassNode>();
+            auto [line, column] = vs.line_info();
+            node->name = ruleNames[i];
+            node->rule = static_cast<uint32_t>(i);
+            node->line = static_cast<uint32_t>(line);
+            node->column = static_cast<uint32_t>(column);
+            node->position = static_cast<uint32_t>(vs.sv().data() - vs.ss);
+            node->length = static_cast<uint32_t>(vs.sv().length());
+            node->nodeCount = static_cast<uint32_t>(vs.size());
+            node->nodes = arena.make_array<BassNode*>(vs.size());
+            for (size_t n = 0; n < vs.size(); n++) {
+                node->nodes[n] = std::any_cast<BassNode*>(vs[n]);
+            }
+            return node;
+        };
+    }
+
     p->log = [this](size_t line, size_t, std::string const& msg) {
         if (!haveError) {
             setError(msg, "", line);
@@ -73,12 +157,159 @@ Parser::Parser(const char* s) : p(std::make_unique<peg::parser>(s))
 }
 Parser::~Parser() = default;
 
-void Parser::packrat() const
+size_t Parser::ruleId(std::string_view name) const
+{
+    auto it = ruleMap.find(name);
+    return it != ruleMap.end() ? it->second : ruleNames.size();
+}
+
+void Parser::packrat(std::vector<std::string> const& rules, size_t limit)
+{
+    usePackrat = true;
+    packratRules = rules;
+    packratLimit = limit;
+    if (rules.empty()) {
+        p->enable_packrat_parsing();
+    } else {
+        p->enable_packrat_parsing(rules, limit);
+    }
+}
+
+void Parser::addPackratStats(std::map<std::string, PackratInfo>& stats) const
+{
+    for (auto const& [name, s] : p->packrat_stats()) {
+        auto& info = stats[name];
+        info.rule = name;
+        info.lookups += s.lookups;
+        info.hits += s.hits;
+    }
+    for (auto const& worker : workers) {
+        worker->addPackratStats(stats);
+    }
+}
+
+std::vector<PackratInfo>
+Parser::packratStats(std::vector<Parser const*> const& parsers)
+{
+    std::map<std::string, PackratInfo> stats;
+    for (auto const* parser : parsers) {
+        parser->addPackratStats(stats);
+    }
+    std::vector<PackratInfo> result;
+    for (auto& [name, info] : stats) {
+        result.push_back(std::move(info));
+    }
+    std::stable_sort(
+        result.begin(), result.end(),
+        [](auto const& a, auto const& b) { return a.hits > b.hits; });
+    return result;
+}
+
+void Parser::profile()
+{
+    profiling = true;
+    profiles.resize(ruleNames.size());
+    profileDepth.resize(ruleNames.size());
+    for (size_t i = 0; i < ruleNames.size(); i++) {
+        profiles[i].rule = ruleNames[i];
+        enter(ruleNames[i].data(), [this, i](const char*, size_t, std::any&) {
+            profiles[i].attempts++;
+            profileDepth[i].first++;
+            startTimer();
+        });
+        leave(ruleNames[i].data(), [this, i](const char*, size_t, size_t len,
+                                             std::any&, std::any&) {
+            auto [total, self] = stopTimer();
+            auto& prof = profiles[i];
+            if (--profileDepth[i].first == 0) {
+                prof.parseTime += total;
+            }
+            prof.parseSelf += self;
+            if (len == static_cast<size_t>(-1)) {
+                prof.backtracks++;
+            } else {
+                prof.successes++;
+            }
+        });
+    }
+}
+
+void Parser::startTimer()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    timers.emplace_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), 0);
+}
+
+std::pair<int64_t, int64_t> Parser::stopTimer()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    auto [start, inner] = timers.back();
+    timers.pop_back();
+    int64_t const total =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() -
+        start;
+    if (!timers.empty()) {
+        timers.back().second += total;
+    }
+    return {total, total - inner};
+}
+
+Value Parser::profileAction(uint32_t rule, SemanticValues& sv,
+                               ActionFn const& fn)
+{
+    profileDepth[rule].second++;
+    startTimer();
+    auto result = callAction(sv, fn);
+    auto [total, self] = stopTimer();
+    auto& prof = profiles[rule];
+    if (--profileDepth[rule].second == 0) {
+        prof.actionTime += total;
+    }
+    prof.actionSelf += self;
+    prof.evaluations++;
+    return result;
+}
+
+void Parser::addProfile(std::map<std::string, RuleProfile>& stats) const
 {
-    p->enable_packrat_parsing();
+    for (auto const& prof : profiles) {
+        auto& info = stats[prof.rule];
+        info.rule = prof.rule;
+        info.attempts += prof.attempts;
+        info.successes += prof.successes;
+        info.backtracks += prof.backtracks;
+        info.parseTime += prof.parseTime;
+        info.parseSelf += prof.parseSelf;
+        info.evaluations += prof.evaluations;
+        info.actionTime += prof.actionTime;
+        info.actionSelf += prof.actionSelf;
+    }
+    for (auto const& worker : workers) {
+        worker->addProfile(stats);
+    }
+}
+
+std::vector<RuleProfile>
+Parser::profileStats(std::vector<Parser const*> const& parsers)
+{
+    std::map<std::string, RuleProfile> stats;
+    for (auto const* parser : parsers) {
+        parser->addProfile(stats);
+    }
+    std::vector<RuleProfile> result;
+    for (auto& [name, info] : stats) {
+        result.push_back(std::move(info));
+    }
+    std::stable_sort(result.begin(), result.end(),
+                     [](auto const& a, auto const& b) {
+                         return a.parseSelf + a.actionSelf >
+                                b.parseSelf + b.actionSelf;
+                     });
+    return result;
 }
 
-std::any Parser::callAction(SemanticValues& sv, ActionFn const& fn)
+Value Parser::callAction(SemanticValues& sv, ActionFn const& fn)
 {
     try {
         return fn(sv);
@@ -89,210 +320,770 @@ std::any Parser::callAction(SemanticValues& sv, ActionFn const& fn)
 }
 
 template <typename FN>
-void forAllNodes(AstNode const& root, FN const& fn)
+void forAllNodesTop(AstNode root, FN const& fn)
 {
-    for (auto const& node : root->nodes) {
-        forAllNodes(node, fn);
-    }
     fn(root);
+    for (uint32_t i = 0; i < root->nodeCount; i++) {
+        forAllNodesTop(root->nodes[i], fn);
+    }
 }
 
-template <typename FN>
-void forAllNodesTop(AstNode const& root, FN const& fn)
+// AST cache file layout. All fields are host endian, and everything is
+// 4-byte aligned so the file can be used directly from memory:
+//
+//   AstCacheHeader
+//   rule names       (ruleCount zero terminated strings, padded to 4 bytes)
+//   AstCacheNode     [nodeCount] (in pre-order, node 0 is the root)
+//   uint32_t         [childCount] (node indices, referenced by the nodes)
+
+constexpr uint32_t AstCacheMagic = 0xba55a570;
+constexpr uint32_t AstCacheVersion = 3;
+
+struct AstCacheHeader
 {
-    fn(root);
-    for (auto const& node : root->nodes) {
-        forAllNodesTop(node, fn);
+    uint32_t magic;
+    uint32_t version;
+    Hash128 grammar;
+    uint32_t sourceSize;
+    uint32_t ruleCount;
+    uint32_t namesSize;
+    uint32_t nodeCount;
+    uint32_t childCount;
+};
+
+struct AstCacheNode
+{
+    uint32_t line;
+    uint32_t column;
+    uint32_t position;
+    uint32_t length;
+    uint32_t rule;
+    uint32_t firstChild;
+    uint32_t childCount;
+};
+
+template <typename T>
+void append(std::vector<uint8_t>& data, T const* ptr, size_t count)
+{
+    auto const* p = reinterpret_cast<uint8_t const*>(ptr);
+    data.insert(data.end(), p, p + count * sizeof(T));
+}
+
+// Write the tree in pre-order, with the child indices of every node in
+// one contiguous range of `children`
+static uint32_t flatten(AstNode node, std::vector<AstCacheNode>& nodes,
+                        std::vector<uint32_t>& children)
+{
+    auto index = static_cast<uint32_t>(nodes.size());
+    auto first = static_cast<uint32_t>(children.size());
+    nodes.push_back({node->line, node->column, node->position, node->length,
+                     node->rule, first, node->nodeCount});
+    children.resize(first + node->nodeCount);
+    for (uint32_t c = 0; c < node->nodeCount; c++) {
+        children[first + c] = flatten(node->nodes[c], nodes, children);
     }
+    return index;
 }
 
-// template <typename FN>
-// void save(AstNode const& root, FN const& fn)
-//{
-//    std::vector<uint8_t> data;
-//    for (auto const& node : root->nodes) {
-//        save(node, fn);
-//    }
-//    fn(root);
-//}
+std::vector<uint8_t> Parser::saveAst(AstNode root) const
+{
+    std::vector<AstCacheNode> nodes;
+    std::vector<uint32_t> children;
+    flatten(root, nodes, children);
 
-void write(utils::File& f, uint32_t const& t)
+    std::vector<uint8_t> names;
+    for (auto const& name : ruleNames) {
+        append(names, name.data(), name.size());
+        names.push_back(0);
+    }
+    names.resize((names.size() + 3) & ~3);
+
+    AstCacheHeader header{};
+    header.magic = AstCacheMagic;
+    header.version = AstCacheVersion;
+    header.grammar = grammarHash;
+    header.sourceSize = static_cast<uint32_t>(root->source.size());
+    header.ruleCount = static_cast<uint32_t>(ruleNames.size());
+    header.namesSize = static_cast<uint32_t>(names.size());
+    header.nodeCount = static_cast<uint32_t>(nodes.size());
+    header.childCount = static_cast<uint32_t>(children.size());
+
+    std::vector<uint8_t> data;
+    data.reserve(sizeof(header) + names.size() +
+                 nodes.size() * sizeof(AstCacheNode) +
+                 children.size() * sizeof(uint32_t));
+    append(data, &header, 1);
+    append(data, names.data(), names.size());
+    append(data, nodes.data(), nodes.size());
+    append(data, children.data(), children.size());
+    return data;
+}
+
+// Create the AST for `currentSource` from cache data. Returns nullptr if
+// the data is from another version, grammar or source.
+AstNode Parser::loadAst(uint8_t const* data, size_t size)
 {
-    if ((t & 0xffff'8000) == 0) {
-        f.write<uint16_t>(t);
-        return;
+    AstCacheHeader header{};
+    if (size < sizeof(header)) {
+        return nullptr;
     }
-    f.write<uint16_t>((t & 0x7fff) | 0x8000);
-    f.write<uint16_t>(t >> 15);
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != AstCacheMagic || header.version != AstCacheVersion ||
+        header.grammar != grammarHash ||
+        header.sourceSize != currentSource.size() || header.nodeCount == 0) {
+        return nullptr;
+    }
+    // Check the sizes before making pointers from them
+    auto const nodesSize =
+        static_cast<size_t>(header.nodeCount) * sizeof(AstCacheNode);
+    if (sizeof(header) + header.namesSize + nodesSize +
+            static_cast<size_t>(header.childCount) * sizeof(uint32_t) !=
+        size) {
+        return nullptr;
+    }
+    auto const* names = data + sizeof(header);
+    auto const* nodeData = names + header.namesSize;
+    auto const* childData = nodeData + nodesSize;
+
+    // Map rule indices in the file to our rule IDs
+    std::vector<uint32_t> rules;
+    rules.reserve(header.ruleCount);
+    auto const* p = names;
+    for (uint32_t i = 0; i < header.ruleCount; i++) {
+        auto const* end = static_cast<uint8_t const*>(
+            memchr(p, 0, nodeData - p));
+        if (end == nullptr) {
+            return nullptr;
+        }
+        auto id = ruleId({reinterpret_cast<const char*>(p),
+                          static_cast<size_t>(end - p)});
+        if (id == ruleNames.size()) {
+            return nullptr;
+        }
+        rules.push_back(static_cast<uint32_t>(id));
+        p = end + 1;
+    }
+
+    std::vector<AstCacheNode> cached(header.nodeCount);
+    memcpy(cached.data(), nodeData, cached.size() * sizeof(AstCacheNode));
+    std::vector<uint32_t> children(header.childCount);
+    memcpy(children.data(), childData, children.size() * sizeof(uint32_t));
+
+    for (auto const& n : cached) {
+        if (n.rule >= rules.size() || n.position > currentSource.size() ||
+            n.length > currentSource.size() - n.position ||
+            n.firstChild > children.size() ||
+            n.childCount > children.size() - n.firstChild) {
+            return nullptr;
+        }
+        for (uint32_t c = 0; c < n.childCount; c++) {
+            auto index = children[n.firstChild + c];
+            if (index <= (&n - cached.data()) || index >= cached.size()) {
+                return nullptr;
+            }
+        }
+    }
+
+    for (auto& n : cached) {
+        n.rule = rules[n.rule];
+    }
+    return buildAst(cached.data(), cached.size(), children.data(),
+                    children.size(), 0, 0);
+}
+
+// Create nodes from flattened data (with rules already mapped to our
+// IDs), moving them `offset` bytes and `lines` lines into the source.
+AstNode Parser::buildAst(AstCacheNode const* cached, size_t count,
+                         uint32_t const* children, size_t childCount,
+                         uint32_t offset, uint32_t lines)
+{
+    // All nodes and child arrays are allocated in one go
+    auto* nodes = arena.make_array<BassNode>(count);
+    auto* links = arena.make_array<BassNode*>(childCount);
+    for (size_t i = 0; i < childCount; i++) {
+        links[i] = &nodes[children[i]];
+    }
+    for (size_t i = 0; i < count; i++) {
+        auto const& n = cached[i];
+        auto& node = nodes[i];
+        node.rule = n.rule;
+        node.name = ruleNames[node.rule];
+        node.line = n.line + lines;
+        node.column = n.column;
+        node.position = n.position + offset;
+        node.length = n.length;
+        node.nodes = n.childCount > 0 ? &links[n.firstChild] : nullptr;
+        node.nodeCount = n.childCount;
+    }
+    return nodes;
 }
 
-uint32_t read(utils::File& f)
+// Split source into top level statements. Every part starts at the
+// beginning of a line outside of any brackets, strings or scripts, so
+// parsing the parts one by one gives the same statements as parsing the
+// whole source. Returns nothing if the source can not be split safely.
+static std::vector<std::string_view> splitStatements(std::string_view source)
 {
-    uint32_t t = f.read<uint16_t>();
-    if ((t & 0x8000) == 0) {
-        return t;
+    std::vector<std::string_view> parts;
+    size_t start = 0;
+    size_t i = 0;
+    int depth = 0;
+    auto skipPast = [&](std::string_view end) {
+        i = source.find(end, i);
+        if (i == std::string_view::npos) {
+            return false;
+        }
+        i += end.size();
+        return true;
+    };
+    while (i < source.size()) {
+        auto c = source[i++];
+        auto next = i < source.size() ? source[i] : 0;
+        if (c == '\n') {
+            if (depth != 0 || i == source.size()) {
+                continue;
+            }
+            // Blocks may start on the line after their declaration
+            auto first = source.find_first_not_of(" \t", i);
+            if (first != std::string_view::npos &&
+                (source[first] == '{' || source.substr(first, 4) == "else")) {
+                continue;
+            }
+            parts.push_back(source.substr(start, i - start));
+            start = i;
+        } else if (c == '%' && next == '{') {
+            if (!skipPast("}%")) {
+                return {};
+            }
+        } else if (c == '{' && next == ':') {
+            if (!skipPast(":}")) {
+                return {};
+            }
+        } else if (c == '"') {
+            if (!skipPast("\"")) {
+                return {};
+            }
+        } else if (c == '\'' && i + 1 < source.size() && source[i + 1] == '\'') {
+            i += 2;
+        } else if (c == ';') {
+            i = std::min(source.find('\n', i), source.size());
+        } else if (c == '(' || c == '[' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == ']' || c == '}') {
+            if (--depth < 0) {
+                return {};
+            }
+        }
+    }
+    if (depth != 0) {
+        return {};
+    }
+    if (start < source.size()) {
+        parts.push_back(source.substr(start));
     }
-    t &= 0x7fff;
-    t |= (f.read<uint16_t>() << 15);
-    return t;
+    return parts;
 }
 
-void Parser::saveAst(utils::File& f, AstNode const& root)
+// A parsed top level statement, kept between parses
+struct ParsedStatement
 {
-    forAllNodesTop(root, [&f, this](AstNode const& node) {
-        write(f, node->line);
-        write(f, node->position);
-        write(f, node->length);
+    std::vector<AstCacheNode> nodes;
+    std::vector<uint32_t> children;
+    bool used;
+};
 
-        auto index = ruleMap[node->name];
-        write(f, index);
-        write(f, node->nodes.size());
-    });
+// Parse source one top level statement at a time, reusing statements
+// that were parsed before. Returns nullptr if any statement fails to
+// parse on its own.
+AstNode Parser::parseStatements(std::string_view source)
+{
+    auto parts = splitStatements(source);
+    if (parts.empty()) {
+        return nullptr;
+    }
+
+    std::vector<BassNode*> statements;
+    uint32_t rootRule = 0;
+    uint32_t lines = 0;
+    for (auto part : parts) {
+        auto offset = static_cast<uint32_t>(part.data() - source.data());
+        AstNode root = nullptr;
+        auto it = parsedStatements.find(std::string(part));
+        if (it != parsedStatements.end()) {
+            auto const& ps = *it->second;
+            root = buildAst(ps.nodes.data(), ps.nodes.size(),
+                            ps.children.data(), ps.children.size(), offset,
+                            lines);
+            it->second->used = true;
+        } else {
+            if (!p->parse_n(part.data(), part.size(), root)) {
+                return nullptr;
+            }
+            auto ps = std::make_unique<ParsedStatement>();
+            flatten(root, ps->nodes, ps->children);
+            ps->used = true;
+            parsedStatements.emplace(part, std::move(ps));
+            forAllNodesTop(root, [&](AstNode node) {
+                node->position += offset;
+                node->line += lines;
+            });
+        }
+        rootRule = root->rule;
+        statements.insert(statements.end(), root->nodes,
+                          root->nodes + root->nodeCount);
+        lines += static_cast<uint32_t>(
+            std::count(part.begin(), part.end(), '\n'));
+    }
+
+    return joinStatements(statements, rootRule, source.size());
 }
 
-AstNode Parser::loadAst(utils::File& f)
+// Splice top level statements into one program
+AstNode Parser::joinStatements(std::vector<BassNode*> const& statements,
+                               uint32_t rule, size_t size)
 {
-    auto line = read(f);
-    auto column = 0;
-    auto pos = read(f);
-    auto len = read(f);
-    auto index = read(f);
-    auto name = ruleNames[index];
-    auto count = read(f);
+    auto* root = arena.make<BassNode>();
+    root->rule = rule;
+    root->name = ruleNames[rule];
+    root->line = 1;
+    root->column = 1;
+    root->position = 0;
+    root->length = static_cast<uint32_t>(size);
+    root->nodeCount = static_cast<uint32_t>(statements.size());
+    root->nodes = arena.make_array<BassNode*>(statements.size());
+    std::copy(statements.begin(), statements.end(), root->nodes);
+    return root;
+}
 
-    auto token = currentSource.substr(pos, len);
-    auto node = std::make_shared<peg::AstBase<BassNode>>(
-        currentFile.c_str(), line, column, name, token, pos, len);
+// Parse a large source in parts on worker threads, and join the results
+// in source order. Returns nullptr if any part fails to parse on its own.
+AstNode Parser::parseParallel(std::string_view source)
+{
+    auto const threadCount =
+        threads != 0 ? threads : std::thread::hardware_concurrency();
+    if (threadCount < 2) {
+        return nullptr;
+    }
+    auto statements = splitStatements(source);
 
-    for (size_t i = 0; i < count; i++) {
-        node->nodes.push_back(loadAst(f));
+    // A few parts per thread, so one slow part does not hold up the rest
+    auto partSize = std::max<size_t>(source.size() / (threadCount * 4),
+                                     ParallelParseSize / 4);
+    std::vector<std::string_view> parts;
+    size_t start = 0;
+    for (auto statement : statements) {
+        auto end = static_cast<size_t>(statement.data() - source.data()) +
+                   statement.size();
+        if (end - start >= partSize || end == source.size()) {
+            parts.push_back(source.substr(start, end - start));
+            start = end;
+        }
+    }
+    if (parts.size() < 2) {
+        return nullptr;
+    }
+
+    auto count = std::min<size_t>(parts.size(), threadCount);
+    while (workers.size() < count) {
+        workers.push_back(clone());
+    }
+    std::vector<AstNode> roots(parts.size(), nullptr);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < count; t++) {
+        pool.emplace_back([&, t] {
+            auto& worker = *workers[t]->p;
+            for (size_t i = next++; i < parts.size(); i = next++) {
+                AstNode root = nullptr;
+                try {
+                    if (worker.parse_n(parts[i].data(), parts[i].size(),
+                                       root)) {
+                        roots[i] = root;
+                    }
+                } catch (std::exception&) {
+                }
+            }
+        });
+    }
+    for (auto& t : pool) {
+        t.join();
+    }
+
+    AstNode result = nullptr;
+    if (std::find(roots.begin(), roots.end(), nullptr) == roots.end()) {
+        std::vector<BassNode*> joined;
+        std::vector<AstCacheNode> nodes;
+        std::vector<uint32_t> children;
+        uint32_t lines = 0;
+        for (size_t i = 0; i < parts.size(); i++) {
+            nodes.clear();
+            children.clear();
+            flatten(roots[i], nodes, children);
+            auto offset = static_cast<uint32_t>(parts[i].data() - source.data());
+            auto* root = buildAst(nodes.data(), nodes.size(), children.data(),
+                                  children.size(), offset, lines);
+            joined.insert(joined.end(), root->nodes,
+                          root->nodes + root->nodeCount);
+            lines += static_cast<uint32_t>(
+                std::count(parts[i].begin(), parts[i].end(), '\n'));
+        }
+        result = joinStatements(joined, roots[0]->rule, source.size());
     }
+    for (size_t t = 0; t < count; t++) {
+        workers[t]->clear();
+    }
+    return result;
+}
 
-    return node;
+void Parser::clear()
+{
+    resetFolds(folding);
+    arena.clear();
+    // Forget statements that were not used since the last clear
+    for (auto it = parsedStatements.begin(); it != parsedStatements.end();) {
+        if (it->second->used) {
+            it->second->used = false;
+            ++it;
+        } else {
+            it = parsedStatements.erase(it);
+        }
+    }
 }
 
-AstNode Parser::parse(std::string_view source, std::string_view file)
+// Remove the least recently used files until the cache fits in `limit`
+// bytes, and return the size of what is left. Other processes may use the
+// cache at the same time, so files can disappear under us; such errors
+// are ignored.
+static uint64_t evictCache(fs::path const& dir, uint64_t limit)
+{
+    std::vector<std::tuple<fs::file_time_type, uint64_t, fs::path>> files;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (fs::directory_iterator it{dir, ec}, end; !ec && it != end;
+         it.increment(ec)) {
+        std::error_code fec;
+        auto size = it->file_size(fec);
+        auto time = it->last_write_time(fec);
+        if (!fec) {
+            total += size;
+            files.emplace_back(time, size, it->path());
+        }
+    }
+    if (total <= limit) {
+        return total;
+    }
+    std::sort(files.begin(), files.end());
+    for (auto const& [time, size, path] : files) {
+        if (total <= limit) {
+            break;
+        }
+        fs::remove(path, ec);
+        total -= size;
+    }
+    return total;
+}
+
+// Write through a temporary file that is renamed into place, so readers
+// never see a partially written file
+static void writeCacheFile(fs::path const& target,
+                           std::vector<uint8_t> const& data)
 {
-    std::array<uint8_t, SHA512_DIGEST_LENGTH> sha; // NOLINT
-    SHA512(reinterpret_cast<const uint8_t*>(source.data()), source.size(),
-           sha.data());
-    auto shaName = hex_encode(sha, 32);
-    fs::path const home = getHomeDir();
-    if (!fs::exists(home / ".basscache")) {
-        fs::create_directories(home / ".basscache");
+    auto temp = target;
+    temp += fmt::format(".{:08x}.tmp", std::random_device{}());
+    std::error_code ec;
+    try {
+        utils::File f{temp.string(), utils::File::Mode::Write};
+        f.write(data);
+        f.close();
+    } catch (utils::io_exception&) {
+        fs::remove(temp, ec);
+        return;
+    }
+    fs::rename(temp, target, ec);
+    if (ec) {
+        fs::remove(temp, ec);
     }
-    auto target = home / ".basscache" / shaName;
+}
 
+AstNode Parser::parse(std::string_view source, std::string_view file)
+{
     currentSource = source;
-    currentFile = file;
 
-    ruleNames.clear();
-    p->get_rule_names(ruleNames);
+    bool const diskCache = useCache && source.size() >= CacheParseSize;
+    fs::path cacheDir;
+    fs::path target;
+    if (diskCache) {
+        cacheDir = cachePath.empty() ? fs::path(getHomeDir()) / ".basscache"
+                                     : fs::path(cachePath);
+        std::error_code ec;
+        fs::create_directories(cacheDir, ec);
+        auto hash = hash128(source.data(), source.size());
+        target = cacheDir / hex_encode(hash, static_cast<int>(hash.size()));
+    }
 
     try {
         AstNode ast = nullptr;
         bool rc = false;
-        if (useCache && fs::exists(target)) {
-            fmt::print("Using cached AST\n");
-            utils::File f{target.string()};
-            auto id = f.read<uint32_t>();
-            if (id != 0xba55a570) {
-                fmt::print(stderr, "**Error: Broken AST\n");
-                exit(1);
+        bool cached = false;
+        if (diskCache) {
+            std::vector<uint8_t> data;
+            try {
+                utils::File f{target.string()};
+                data = f.readAll();
+            } catch (utils::io_exception&) {
             }
-            std::array<uint8_t, 32> gs; //NOLINT
-            f.read(gs.data(), 32);
-            if(memcmp(gs.data(), grammarSHA.data(), 32) == 0) {
-                ast = loadAst(f);
-                rc = true;
-            } else {
-                fmt::print("**Warn: Old grammar in AST\n");
+            if (!data.empty()) {
+                ast = loadAst(data.data(), data.size());
+                if (ast != nullptr) {
+                    if (!quiet) {
+                        fmt::print("Using cached AST\n");
+                    }
+                    rc = cached = true;
+                    // Mark as recently used
+                    std::error_code ec;
+                    fs::last_write_time(
+                        target, fs::file_time_type::clock::now(), ec);
+                } else {
+                    if (!quiet) {
+                        fmt::print("**Warn: Outdated AST in cache\n");
+                    }
+                }
             }
         }
 
-        if(ast == nullptr)
-        {
-            rc = p->parse_n(source.data(), source.length(), ast);
-            if (rc) {
-                for (size_t i = 0; i < ruleNames.size(); i++) {
-                    ruleMap[ruleNames[i]] = i;
-                }
-                if (useCache) {
-                    utils::File f{target.string(), utils::File::Mode::Write};
-                    f.write<uint32_t>(0xba55a570);
-                    f.write(grammarSHA.data(), 32);
-                    saveAst(f, ast);
-                    f.close();
-                }
+        if (ast == nullptr && incremental && !source.empty()) {
+            // On failure, parse again as a whole to report the error
+            // with the right position
+            auto const savedError = currentError;
+            auto const hadError = haveError;
+            ast = parseStatements(source);
+            if (ast != nullptr) {
+                rc = cached = true;
+            } else {
+                currentError = savedError;
+                haveError = hadError;
             }
         }
+        if (ast == nullptr && threads != 1 &&
+            source.size() >= ParallelParseSize) {
+            // On failure, parse again as a whole to report the error
+            auto const savedError = currentError;
+            auto const hadError = haveError;
+            ast = parseParallel(source);
+            rc = ast != nullptr;
+            currentError = savedError;
+            haveError = hadError;
+        }
+        if (ast == nullptr) {
+            rc = p->parse_n(source.data(), source.length(), ast);
+        }
         if (rc) {
-
-            // ast = peg::AstOptimizer(true, exceptions).optimize(ast);
-            forAllNodes(ast, [source, file, this](auto const& node) {
-                node->source = source;
-                node->file_name = file;
-                auto it = postActions.find(std::string(node->name));
-                if (it != postActions.end()) {
-                    node->action = &it->second;
+            compile(ast, source, *fileNames.emplace(file).first);
+            if (diskCache && !cached) {
+                auto const data = saveAst(ast);
+                writeCacheFile(target, data);
+                // Only scan the directory when it may have grown too big
+                cacheUsage += data.size();
+                if (!cacheScanned || cacheUsage > cacheLimit) {
+                    cacheUsage = evictCache(cacheDir, cacheLimit);
+                    cacheScanned = true;
                 }
-            });
+            }
             return ast;
         }
         currentError.file = file;
         return nullptr;
     } catch (peg::parse_error& e) {
-        fmt::print("## Unhandled Parse error: {}\n", e.what());
+        if (!quiet) {
+            fmt::print("## Unhandled Parse error: {}\n", e.what());
+        }
         setError(e.what(), file, 0);
         return nullptr;
     }
 }
 
-std::any Parser::evaluate(AstNode const& node)
+std::unique_ptr<Parser> Parser::clone() const
+{
+    auto parser = std::make_unique<Parser>(grammarText);
+    parser->useCache = useCache;
+    parser->cachePath = cachePath;
+    parser->cacheLimit = cacheLimit;
+    if (usePackrat) {
+        parser->packrat(packratRules, packratLimit);
+    }
+    if (profiling) {
+        parser->profile();
+    }
+    // Clones already run on worker threads
+    parser->threads = 1;
+    parser->quiet = true;
+    return parser;
+}
+
+AstNode Parser::copyAst(AstNode root, std::string_view source,
+                        std::string_view file)
+{
+    std::vector<AstCacheNode> nodes;
+    std::vector<uint32_t> children;
+    flatten(root, nodes, children);
+    auto* ast = buildAst(nodes.data(), nodes.size(), children.data(),
+                         children.size(), 0, 0);
+    compile(ast, source, *fileNames.emplace(file).first);
+    return ast;
+}
+
+// Lower the tree into a flat, pre-order list of ops, so evaluation does
+// not need to recurse through the nodes.
+void Parser::compile(AstNode root, std::string_view source,
+                     std::string_view file)
 {
-    // LOGI("Evaluate %s", node->name);
-    std::string const spaces{
-        "                                                        "};
+    uint32_t count = 0;
+    forAllNodesTop(root, [&](AstNode) { count++; });
+
+    auto* program = arena.make_array<AstOp>(count);
+    uint32_t i = 0;
+    forAllNodesTop(root, [&](AstNode node) {
+        node->source = source;
+        node->file_name = file;
+        node->program = program;
+        node->op = i;
+        node->v = arena.make_array<Value>(node->nodeCount);
+        node->vcount = 0;
+        program[i++] = {node, 0, node->rule};
+    });
+    // Every subtree is contiguous, so its end is where the last
+    // child's subtree ends
+    while (i-- > 0) {
+        auto* node = program[i].node;
+        program[i].end = node->nodeCount == 0
+                             ? i + 1
+                             : program[node->nodes[node->nodeCount - 1]->op].end;
+    }
 
-    std::function<std::any(AstNode const&, int)> const eval =
-        [this, &eval](AstNode const& ast, int indent) -> std::any {
-        bool descend = true;
-        auto it0 = preActions.find(std::string(ast->name));
-        if (it0 != preActions.end()) {
-            SemanticValues const sv{ast};
-            descend = it0->second(sv);
+    // Find the constant subtrees. Children come after their parent, so
+    // they are done first.
+    for (auto j = count; j-- > 0;) {
+        auto* node = program[j].node;
+        bool pure = pureRules[node->rule];
+        for (uint32_t n = 0; pure && n < node->nodeCount; n++) {
+            pure = node->nodes[n]->foldable;
         }
+        if (pure && pureChecks[node->rule]) {
+            pure = pureChecks[node->rule](SemanticValues{node});
+        }
+        node->foldable = pure;
+        for (uint32_t n = 0; n < node->nodeCount; n++) {
+            node->nodes[n]->foldRoot = node->nodes[n]->foldable && !pure;
+        }
+    }
+    root->foldRoot = root->foldable;
+}
 
-        if (descend) {
-            const auto& nodes = ast->nodes;
-            ast->v.clear();
-            for (auto const& node : nodes) {
-                auto v = eval(node, indent - 2);
-                ast->v.push_back(v);
-            }
+Value Parser::evaluate(AstNode node)
+{
+    auto const* program = node->program;
+
+    // Actions may evaluate other nodes, which then use the stacks above
+    // our part of them. Put them back if an action throws.
+    struct StackGuard
+    {
+        Parser& parser;
+        size_t valueBase;
+        size_t frameBase;
+        ~StackGuard()
+        {
+            parser.values.resize(valueBase);
+            parser.frames.resize(frameBase);
         }
-        if (ast->action != nullptr) {
+    } const guard{*this, values.size(), frames.size()};
+
+    // Run the action for a node whose children (if any) have been evaluated
+    auto reduce = [this](AstOp const& op) -> Value {
+        auto* ast = op.node;
+        auto const& action = postActions[op.rule];
+        if (action) {
             SemanticValues sv{ast};
             if (tracing) {
                 fmt::print("\n{} (line {}): "
                            "'{}'\n-------------------------------------\n",
                            sv.name(), ast->line, sv.token_view());
-                for (size_t i = 0; i < sv.size(); i++) {
-                    std::any const v = sv[i];
-                    fmt::print("  {}: {}\n", i, any_to_string(v));
+                for (size_t n = 0; n < sv.size(); n++) {
+                    Value const& v = sv[n];
+                    fmt::print("  {}: {}\n", n, any_to_string(v));
                 }
-                auto ret = callAction(sv, *ast->action);
+                auto ret = callAction(sv, action);
                 fmt::print(">>  {}\n", any_to_string(ret));
                 return ret;
             }
-            return callAction(sv, *ast->action);
+            if (profiling) {
+                return profileAction(op.rule, sv, action);
+            }
+            return callAction(sv, action);
         }
-        if (!ast->v.empty()) {
-            return ast->v.front();
+        if (ast->vcount > 0) {
+            return ast->v[0];
         }
         return {};
     };
-    return eval(node, 54);
+
+    // Keep the value of a constant subtree, unless something in it
+    // depended on the pass
+    auto fold = [this](AstNode ast, uint32_t barriers, Value const& v) {
+        if (folding && ast->foldRoot && barriers == foldBarriers) {
+            ast->folded = &foldedValues.emplace_back(v);
+            foldedNodes.push_back(ast);
+        }
+    };
+
+    uint32_t i = node->op;
+    while (true) {
+        auto const& op = program[i];
+        Value result;
+        if (op.node->folded != nullptr) {
+            result = *op.node->folded;
+        } else {
+            bool descend = true;
+            if (auto const& before = preActions[op.rule]) {
+                SemanticValues const sv{op.node};
+                descend = before(sv);
+            }
+            if (descend) {
+                if (op.end != i + 1) {
+                    frames.push_back({i, static_cast<uint32_t>(values.size()),
+                                      foldBarriers});
+                    i++;
+                    continue;
+                }
+                op.node->vcount = 0;
+            }
+            auto const barriers = foldBarriers;
+            result = reduce(op);
+            fold(op.node, barriers, result);
+        }
+
+        // Hand the result to the parent, and move on to the next
+        // sibling or reduce the parent if this was the last child
+        while (true) {
+            if (frames.size() == guard.frameBase) {
+                return result;
+            }
+            values.push_back(std::move(result));
+            auto const [parent, first, barriers] = frames.back();
+            auto next = program[i].end;
+            if (next != program[parent].end) {
+                i = next;
+                break;
+            }
+            frames.pop_back();
+            i = parent;
+            auto* ast = program[i].node;
+            ast->vcount = static_cast<uint32_t>(values.size() - first);
+            std::move(values.begin() + first, values.end(), ast->v);
+            values.resize(first);
+            result = reduce(program[i]);
+            fold(ast, barriers, result);
+        }
+    }
 }
 
 void Parser::enter(
@@ -321,23 +1112,66 @@ void Parser::setError(std::string const& what, std::string_view file,
 }
 
 void Parser::after(const char* name,
-                   std::function<std::any(SemanticValues const&)> const& fn)
+                   std::function<Value(SemanticValues const&)> const& fn)
 {
-    auto names = p->get_rule_names();
-    auto it = std::find(names.begin(), names.end(), name);
-    if (it == names.end()) {
+    auto id = ruleId(name);
+    if (id == ruleNames.size()) {
         LOGI("Unknown rule %s", name);
+        return;
+    }
+    postActions[id] = fn;
+}
+
+void Parser::pure(const char* name,
+                  std::function<bool(SemanticValues const&)> const& check)
+{
+    auto id = ruleId(name);
+    if (id == ruleNames.size()) {
+        throw parse_error("Unknown rule "s + name);
+    }
+    pureRules[id] = true;
+    pureChecks[id] = check;
+}
+
+bool Parser::isPure(
+    AstNode node,
+    std::function<bool(SemanticValues const&)> const& accept) const
+{
+    if (node->foldable) {
+        return true;
+    }
+    if (!pureRules[node->rule]) {
+        return false;
+    }
+    auto const& check = pureChecks[node->rule];
+    SemanticValues const sv{node};
+    if (check && !check(sv) && !accept(sv)) {
+        return false;
+    }
+    for (uint32_t n = 0; n < node->nodeCount; n++) {
+        if (!isPure(node->nodes[n], accept)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Parser::resetFolds(bool on)
+{
+    for (auto* node : foldedNodes) {
+        node->folded = nullptr;
     }
-    postActions[name] = fn;
+    foldedNodes.clear();
+    foldedValues.clear();
+    folding = on;
 }
 
 void Parser::before(const char* name,
                     std::function<bool(SemanticValues const&)> const& fn)
 {
-    auto names = p->get_rule_names();
-    auto it = std::find(names.begin(), names.end(), name);
-    if (it == names.end()) {
+    auto id = ruleId(name);
+    if (id == ruleNames.size()) {
         throw parse_error("Unknown rule "s + name);
     }
-    preActions[name] = fn;
+    preActions[id] = fn;
 }
@@ -1,29 +1,33 @@
 #pragma once
 
+#include "arena.h"
+#include "hash.h"
+#include "value.h"
+
 #include <any>
 #include <coreutils/file.h>
 #include <deque>
 #include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-extern "C"
-{
-#include <sha512.h>
-}
-
 namespace peg {
 class parser;
-template <typename T>
-struct AstBase;
 } // namespace peg
 
+// AST nodes live in the arena of the Parser that created them, and are
+// valid until the Parser is cleared.
 struct BassNode;
-using AstNode = std::shared_ptr<peg::AstBase<BassNode>>;
+using AstNode = BassNode*;
+
+struct AstCacheNode;
+struct ParsedStatement;
 
 template <typename C>
 inline std::string hex_encode(C const& c, int len = 0)
@@ -42,31 +46,34 @@ inline std::string hex_encode(C const& c, int len = 0)
 
 class SemanticValues
 {
-    std::shared_ptr<peg::AstBase<BassNode>> const& ast;
+    BassNode* ast;
 
 public:
-    explicit SemanticValues(AstNode const&);
+    explicit SemanticValues(BassNode*);
     ~SemanticValues() = default;
     size_t line() const { return line_info().first; }
     std::pair<size_t, size_t> line_info() const;
-    std::any operator[](size_t i) const;
+    Value const& operator[](size_t i) const;
     std::string_view token_view() const;
     size_t size() const;
     std::string_view name() const;
+    size_t rule() const;
 
     AstNode get_node() const { return ast; }
-    std::string const& file_name() const;
+    std::string_view file_name() const;
 
     template <typename T>
     T to(size_t i) const
     {
-        return std::any_cast<T>(operator[](i));
+        return value_cast<T>(operator[](i));
     }
 };
 
-using ActionFn = std::function<std::any(SemanticValues const&)>;
+using ActionFn = std::function<Value(SemanticValues const&)>;
 
 AstNode get_child(AstNode node, size_t i);
+// Call `fn` for `root` and all nodes below it, in pre-order
+void for_all_nodes(AstNode root, std::function<void(AstNode)> const& fn);
 
 enum class ErrLevel
 {
@@ -88,26 +95,120 @@ struct Error
     ErrLevel level{ErrLevel::Error};
 };
 
+struct PackratInfo
+{
+    std::string rule;
+    size_t lookups = 0;
+    size_t hits = 0;
+};
+
+// Parse and evaluation profile of a grammar rule. Times are in nanoseconds;
+// the totals count recursive calls once, the self times leave out the time
+// spent in inner rules and actions.
+struct RuleProfile
+{
+    std::string rule;
+    size_t attempts = 0;
+    size_t successes = 0;
+    size_t backtracks = 0;
+    int64_t parseTime = 0;
+    int64_t parseSelf = 0;
+    size_t evaluations = 0;
+    int64_t actionTime = 0;
+    int64_t actionSelf = 0;
+};
+
 class Parser
 {
+    const char* grammarText;
     Error currentError;
     bool tracing = false;
-    std::unordered_map<std::string, std::function<bool(SemanticValues const&)>>
-        preActions;
-    std::unordered_map<std::string, ActionFn> postActions;
-    std::string currentFile;
+    // Rule actions, indexed by rule ID
+    std::vector<std::function<bool(SemanticValues const&)>> preActions;
+    std::vector<ActionFn> postActions;
+    // Rules with values that only depend on their text and children, and
+    // extra conditions for some of them
+    std::vector<bool> pureRules;
+    std::vector<std::function<bool(SemanticValues const&)>> pureChecks;
     std::string_view currentSource;
+    // Rule names sorted, so the index of a name is the rule ID
     std::vector<std::string_view> ruleNames;
     std::unordered_map<std::string_view, size_t> ruleMap;
 
-    std::array<uint8_t, SHA512_DIGEST_LENGTH> grammarSHA{};
+    Hash128 grammarHash{};
 
     std::unique_ptr<peg::parser> p;
     bool haveError{false};
 
-    std::any callAction(SemanticValues& sv, ActionFn const& fn);
+    // Holds all AST nodes, and everything they point to
+    Arena arena;
+    std::unordered_set<std::string> fileNames;
+
+    // Evaluation stacks; child values, and the nodes being evaluated with
+    // their first value and the noFold() count when they were entered
+    struct Frame
+    {
+        uint32_t op;
+        uint32_t first;
+        uint32_t barriers;
+    };
+    std::vector<Value> values;
+    std::vector<Frame> frames;
+
+    // Kept values of constant subtrees, and the nodes they belong to
+    bool folding = true;
+    uint32_t foldBarriers = 0;
+    std::deque<Value> foldedValues;
+    std::vector<AstNode> foldedNodes;
+
+    // Statements parsed in incremental mode, by source text
+    std::unordered_map<std::string, std::unique_ptr<ParsedStatement>>
+        parsedStatements;
+
+    // Per rule profile by rule ID, and how many parses and actions of the
+    // rule are running, when profiling
+    bool profiling = false;
+    std::vector<RuleProfile> profiles;
+    std::vector<std::pair<uint32_t, uint32_t>> profileDepth;
+    // Start time, and time spent in inner timers, of the running rules and
+    // actions
+    std::vector<std::pair<int64_t, int64_t>> timers;
+
+    Value callAction(SemanticValues& sv, ActionFn const& fn);
+    Value profileAction(uint32_t rule, SemanticValues& sv,
+                           ActionFn const& fn);
+    void startTimer();
+    // Returns the total and self time of the innermost timer
+    std::pair<int64_t, int64_t> stopTimer();
+    void addProfile(std::map<std::string, RuleProfile>& stats) const;
+    void compile(AstNode root, std::string_view source, std::string_view file);
+    AstNode buildAst(AstCacheNode const* cached, size_t count,
+                     uint32_t const* children, size_t childCount,
+                     uint32_t offset, uint32_t lines);
+    AstNode parseStatements(std::string_view source);
+    AstNode parseParallel(std::string_view source);
+    void addPackratStats(std::map<std::string, PackratInfo>& stats) const;
+    AstNode joinStatements(std::vector<BassNode*> const& statements,
+                           uint32_t rule, size_t size);
+
+    // Parsers for the parts of large sources
+    std::vector<std::unique_ptr<Parser>> workers;
 
     bool useCache = true;
+    bool incremental = false;
+    // Threads used to parse large sources, or 0 for one per CPU
+    unsigned threads = 0;
+    bool usePackrat = false;
+    std::vector<std::string> packratRules;
+    size_t packratLimit = 0;
+    bool quiet = false;
+    // Cache directory, or empty for the default
+    std::string cachePath;
+    uint64_t cacheLimit = 128 * 1024 * 1024;
+    // Size of the cache directory as of the last scan, plus what was
+    // written since
+    uint64_t cacheUsage = 0;
+    bool cacheScanned = false;
 
 public:
     ~Parser();
@@ -116,12 +217,60 @@ public:
     void setError(std::string const& what, std::string_view file, size_t line);
 
     void use_cache(bool on) { useCache = on; }
+    void set_cache_dir(std::string const& dir) { cachePath = dir; }
+    // Max total size of the cache directory, in bytes. The least
+    // recently used files are removed to stay below it.
+    void set_cache_limit(uint64_t bytes) { cacheLimit = bytes; }
+    // Parse top level statements separately, and keep them between
+    // parses so only changed statements are parsed again
+    void use_incremental(bool on) { incremental = on; }
+    // Parse large sources in parts on `n` threads, or on one per CPU if
+    // `n` is 0
+    void set_threads(unsigned n) { threads = n; }
+    bool is_incremental() const { return incremental; }
+
+    // Create a parser for the same grammar and with the same cache
+    // settings, that does not print anything. Use it to parse on
+    // another thread, and copyAst() the result back.
+    std::unique_ptr<Parser> clone() const;
+    // Copy an AST created by a clone() of this parser
+    AstNode copyAst(AstNode root, std::string_view source,
+                    std::string_view file);
 
-    void packrat() const;
+    // Memoize the results of `rules` (all rules if empty), using at most
+    // `limit` bytes of packrat tables per parse
+    void packrat(std::vector<std::string> const& rules = {},
+                 size_t limit = SIZE_MAX);
+    // Packrat statistics of all parses by `parsers` and their workers,
+    // most cache hits first
+    static std::vector<PackratInfo>
+    packratStats(std::vector<Parser const*> const& parsers);
+    // Count and time the matches and actions of all rules
+    void profile();
+    // Profile of all parses and evaluations by `parsers` and their
+    // workers, most time consuming rules first
+    static std::vector<RuleProfile>
+    profileStats(std::vector<Parser const*> const& parsers);
     void before(const char* name,
                 std::function<bool(SemanticValues const&)> const& fn);
     void after(const char* name,
-               std::function<std::any(SemanticValues const&)> const& fn);
+               std::function<Value(SemanticValues const&)> const& fn);
+    // The value of `name` only depends on its text and the values of its
+    // children, and on `check` returning true for the node if given.
+    // Subtrees of such nodes give the same value every time, so their
+    // value is kept after the first evaluation.
+    void pure(const char* name,
+              std::function<bool(SemanticValues const&)> const& check = {});
+    // True if the subtree at `node` is constant like those of pure(),
+    // where `accept` may allow nodes of pure rules that fail their check
+    bool isPure(AstNode node,
+                std::function<bool(SemanticValues const&)> const& accept)
+        const;
+    // Called by actions with a value that depends on the pass, so no
+    // value that contains it is kept
+    void noFold() { foldBarriers++; }
+    // Forget all kept values, and keep no more if `on` is false
+    void resetFolds(bool on = true);
 
     void
     enter(const char* name,
@@ -131,13 +280,22 @@ public:
                                   std::any&)> const&) const;
     Error getError() const { return currentError; }
 
+    size_t ruleCount() const { return ruleNames.size(); }
+    std::string_view ruleName(size_t id) const { return ruleNames[id]; }
+    size_t ruleId(std::string_view name) const;
+
     AstNode parse(std::string_view source, std::string_view file);
 
-    std::any evaluate(AstNode const& node);
+    Value evaluate(AstNode node);
+
+    // Free all ASTs created by this parser, and statements not used
+    // since the last clear
+    void clear();
+    size_t memoryUsage() const { return arena.capacity(); }
 
     void doTrace(bool on) { tracing = on; };
-    void saveAst(utils::File& f, const AstNode& root);
-    AstNode loadAst(utils::File& f);
+    std::vector<uint8_t> saveAst(AstNode root) const;
+    AstNode loadAst(uint8_t const* data, size_t size);
 };
 
 class parse_error : public std::exception
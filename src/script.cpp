@@ -47,7 +47,8 @@ function to_string( tbl )
 end
 )";
 
-Scripting::Scripting() : luap(std::make_unique<sol::state>()), lua(*luap)
+Scripting::Scripting(StringArena& strings_)
+    : luap(std::make_unique<sol::state>()), lua(*luap), strings(strings_)
 {
     lua.open_libraries(sol::lib::base, sol::lib::package, sol::lib::string, sol::lib::io,
                        sol::lib::math, sol::lib::table, sol::lib::debug);
@@ -96,16 +97,13 @@ bool Scripting::hasFunction(std::string_view name)
     return test.valid();
 }
 
-std::any Scripting::to_any(sol::object const& obj)
+Value Scripting::to_value(sol::object const& obj)
 {
     if (obj.is<Number>()) {
         return obj.as<Number>();
     }
     if (obj.is<std::string>()) {
-        auto s = obj.as<std::string>();
-        std::string_view sv = s;
-        persist(sv);
-        return sv;
+        return strings.persist(obj.as<std::string>());
     }
 
     if (obj.is<sol::table>()) {
@@ -130,24 +128,24 @@ std::any Scripting::to_any(sol::object const& obj)
                 }
             } else {
                 auto s = key.as<std::string>();
-                syms[s] = to_any(val);
+                syms[s] = to_value(val);
             }
         });
         // TODO: If table was empty it will become symbols
-        return isVec ? std::any(vec) : std::any(syms);
+        return isVec ? Value(vec) : Value(syms);
     }
     return {};
 }
 
-sol::object Scripting::to_object(std::any const& a)
+sol::object Scripting::to_object(Value const& a)
 {
-    if (auto const* an = std::any_cast<Number>(&a)) {
+    if (auto an = value_cast<Number>(&a)) {
         return sol::make_object(lua, *an);
     }
-    if (auto const* as = std::any_cast<std::string_view>(&a)) {
+    if (auto const* as = value_cast<std::string_view>(&a)) {
         return sol::make_object(lua, *as);
     }
-    if (auto const* av = std::any_cast<std::vector<uint8_t>>(&a)) {
+    if (auto const* av = value_cast<Bytes>(&a)) {
         // TODO: Can we sol make this 'value' conversion?
         // return sol::make_object(lua, *av);
         sol::table t = lua.create_table();
@@ -157,7 +155,7 @@ sol::object Scripting::to_object(std::any const& a)
         }
         return t;
     }
-    if (auto const* avn = std::any_cast<std::vector<Number>>(&a)) {
+    if (auto const* avn = value_cast<Numbers>(&a)) {
         // TODO: Can we sol make this 'value' conversion?
         // return sol::make_object(lua, *av);
         sol::table t = lua.create_table();
@@ -167,7 +165,7 @@ sol::object Scripting::to_object(std::any const& a)
         }
         return t;
     }
-    if (auto const* at = std::any_cast<AnyMap>(&a)) {
+    if (auto const* at = value_cast<AnyMap>(&a)) {
         sol::table t = lua.create_table();
         for (auto const& [name, val] : *at) {
             t[name] = to_object(val);
@@ -177,8 +175,8 @@ sol::object Scripting::to_object(std::any const& a)
     return sol::object{};
 }
 
-std::any Scripting::call(std::string_view name,
-                         std::vector<std::any> const& args)
+Value Scripting::call(std::string_view name,
+                         std::vector<Value> const& args)
 {
     std::vector<sol::object> objs;
     sol::protected_function test = lua[name];
@@ -195,5 +193,5 @@ std::any Scripting::call(std::string_view name,
         throw script_error(what);
     }
     sol::object res = fres;
-    return to_any(res);
+    return to_value(res);
 }
@@ -2,7 +2,6 @@
 
 #include "defines.h"
 
-#include <any>
 #include <functional>
 #include <memory>
 #include <sol/forward.hpp>
@@ -22,17 +21,17 @@ private:
 class Scripting
 {
 public:
-    Scripting();
+    explicit Scripting(StringArena& strings);
     ~Scripting();
     void load(fs::path const& p);
     void add(std::string_view code);
     bool hasFunction(std::string_view name);
-    std::any call(std::string_view name, std::vector<std::any> const& args);
+    Value call(std::string_view name, std::vector<Value> const& args);
 
     sol::state& getState() { return *luap; }
 
-    sol::object to_object(std::any const& a);
-    std::any to_any(sol::object const& obj);
+    sol::object to_object(Value const& a);
+    Value to_value(sol::object const& obj);
 
     static constexpr int StartIndex = 1;
     std::function<void()> make_function(std::string_view code);
@@ -40,4 +39,6 @@ public:
 private:
     std::unique_ptr<sol::state> luap;
     sol::state& lua;
+    // Holds the strings returned by scripts
+    StringArena& strings;
 };
@@ -60,6 +60,9 @@ void registerLuaFunctions(Assembler& assembler, Scripting& scripting)
     };
 
     lua["sym"] = [&](std::string const& name) {
+        if (auto const* bound = assembler.findBound(name)) {
+            return scripting.to_object(*bound);
+        }
         auto aval = assembler.getSymbols().get(name);
         return scripting.to_object(aval);
     };
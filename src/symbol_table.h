@@ -3,11 +3,14 @@
 #include <coreutils/log.h>
 #include <coreutils/text.h>
 
+#include "value.h"
+
 #include <fmt/format.h>
 
-#include <any>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <optional>
-#include <set>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -15,8 +18,6 @@
 
 #include <cassert>
 
-using AnyMap = std::unordered_map<std::string, std::any>;
-
 class sym_error : public std::exception
 {
 public:
@@ -27,13 +28,130 @@ private:
     std::string msg;
 };
 
+// Symbol names are interned as atoms; small integers that index the
+// arrays of a SymbolTable. Copies of a table share its atoms, so they
+// stay valid.
+using Atom = uint32_t;
+
+// Not the atom of any name
+constexpr Atom NoAtom = ~Atom{0};
+
+class Atoms
+{
+public:
+    Atom get(std::string_view name)
+    {
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        // `a.b.c` is a child of `a.b`, which is a child of `a`
+        auto dot = name.rfind('.');
+        auto parent =
+            dot != std::string_view::npos ? get(name.substr(0, dot)) : NoAtom;
+        auto const& s = names.emplace_back(name);
+        children.emplace_back();
+        auto id = static_cast<Atom>(names.size() - 1);
+        ids.emplace(s, id);
+        if (parent != NoAtom) {
+            children[parent].push_back(id);
+        }
+        return id;
+    }
+
+    // The atom of `name`, or NoAtom if it was never interned
+    Atom find(std::string_view name) const
+    {
+        auto it = ids.find(name);
+        return it != ids.end() ? it->second : NoAtom;
+    }
+
+    // Call `fn` for every atom in the namespace of `atom`, that is for
+    // every name beginning with its name and a dot
+    template <typename FN>
+    void forEachMember(Atom atom, FN const& fn) const
+    {
+        if (atom >= children.size()) {
+            return;
+        }
+        auto const& list = children[atom];
+        for (size_t i = 0; i < list.size(); i++) {
+            auto child = list[i];
+            fn(child);
+            forEachMember(child, fn);
+        }
+    }
+
+    std::string const& name(Atom atom) const { return names[atom]; }
+
+    size_t size() const { return names.size(); }
+
+private:
+    // Keys point into `names`, which never moves its strings
+    std::unordered_map<std::string_view, Atom> ids;
+    std::deque<std::string> names;
+    std::deque<std::vector<Atom>> children;
+};
+
+// A set of atoms, as one bit per atom
+class AtomSet
+{
+public:
+    bool contains(Atom atom) const
+    {
+        return atom < bits.size() && bits[atom];
+    }
+
+    void insert(Atom atom)
+    {
+        if (atom >= bits.size()) {
+            bits.resize(atom + 1);
+        }
+        if (!bits[atom]) {
+            bits[atom] = true;
+            count++;
+        }
+    }
+
+    void erase(Atom atom)
+    {
+        if (contains(atom)) {
+            bits[atom] = false;
+            count--;
+        }
+    }
+
+    template <typename FN>
+    void forEach(FN const& fn) const
+    {
+        for (Atom a = 0; count > 0 && a < bits.size(); a++) {
+            if (bits[a]) {
+                fn(a);
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear()
+    {
+        bits.clear();
+        count = 0;
+    }
+
+private:
+    std::vector<bool> bits;
+    size_t count = 0;
+};
+
 // SymbolTable for use in DSL. Remembers undefined references
 // and value changes. Handles dot notation.
 // Setting specific type checks if value changed
 
 struct Symbol
 {
-    std::any value;
+    Value value;
 
     // This symbol is constant and may only be set once.
     bool final{false};
@@ -42,46 +160,68 @@ struct Symbol
 
 struct SymbolTable
 {
-    std::unordered_map<std::string, Symbol> syms;
-    std::unordered_set<std::string> undefined;
-    std::unordered_set<std::string> accessed;
+    // Symbols are stored as columns indexed by atom; their values, and a
+    // bit per symbol for each flag. Only atoms in `defined` hold a value.
+    std::shared_ptr<Atoms> atoms = std::make_shared<Atoms>();
+    std::vector<Value> values;
+    AtomSet defined;
+    AtomSet finals;
+    AtomSet undefined;
+    AtomSet accessed;
     bool trace = false;
     bool undef_ok = true;
 
+    // Changes when a lambda is added, removed or replaced, so function
+    // calls can cache what a name refers to. Versions are never reused,
+    // also not when a table is restored from a copy.
+    static inline std::atomic<uint64_t> versions{0};
+    uint64_t version{++versions};
+
     void accept_undefined(bool ok) { undef_ok = ok; }
 
+    // The atom of `name`, interned if new
+    Atom atom(std::string_view name) { return atoms->get(name); }
+    // The atom of `name`, or NoAtom; for lookups that add nothing
+    Atom find(std::string_view name) const { return atoms->find(name); }
+    std::string const& name_of(Atom a) const { return atoms->name(a); }
+
     bool is_accessed(std::string_view name) const
     {
-        return accessed.find(std::string(name)) != accessed.end();
+        return accessed.contains(find(name));
     }
 
-    bool is_defined(std::string_view name) const
+    bool is_defined(Atom a) const
     {
-        // A symbol is defined when contained in the "syms" list
+        // A symbol is defined when contained in the "defined" set
         // and *not* contained in the "undefined" set
-        std::string s {name};
-        bool defined = undefined.count(s) == 0;
-        defined &= syms.count(s) > 0;
-        return defined;
+        return defined.contains(a) && !undefined.contains(a);
+    }
+
+    bool is_defined(std::string_view name) const
+    {
+        return is_defined(find(name));
     }
 
-    bool is_redefinable(std::string_view name) const {
-        std::string s {name};
-        auto const it = syms.find(s);
-        if (it != syms.end() && it->second.final) {
+    bool is_redefinable(Atom a) const {
+        if (defined.contains(a) && finals.contains(a)) {
             // symbol exists and marked final
-            return undefined.count(s) > 0;
+            return undefined.contains(a);
         }
 
         return true;
     }
 
+    bool is_redefinable(std::string_view name) const
+    {
+        return is_redefinable(find(name));
+    }
+
     void set_sym(std::string_view name, AnyMap const& symbols)
     {
         auto s = std::string(name);
         for (auto const& p : symbols) {
-            if (p.second.type() == typeid(AnyMap{})) {
-                set_sym(s + "." + p.first, std::any_cast<AnyMap>(p.second));
+            if (auto const* m = p.second.get_if<AnyMap>()) {
+                set_sym(s + "." + p.first, *m);
             } else {
                 auto key = s + "." + p.first;
                 set(key, p.second);
@@ -91,44 +231,76 @@ struct SymbolTable
 
     void set_sym(std::string_view name, Symbol const& sym)
     {
-        syms[std::string(name)] = sym;
+        auto a = atom(name);
+        auto& old = slot(a);
+        touch(old, sym.value);
+        old = sym.value;
+        if (sym.final) {
+            finals.insert(a);
+        } else {
+            finals.erase(a);
+        }
     }
 
     std::optional<Symbol> get_sym(std::string_view name) const
     {
-        auto it = syms.find(std::string(name));
-        return it != syms.end() ? std::optional(it->second) : std::nullopt;
+        auto a = find(name);
+        if (!defined.contains(a)) {
+            return std::nullopt;
+        }
+        return Symbol{values[a], finals.contains(a)};
     }
 
-    void set(std::string_view name, std::any const& val)
+    void set(std::string_view name, Value const& val)
     {
-        if (val.type() == typeid(AnyMap)) {
-            set_sym(name, std::any_cast<AnyMap>(val));
-        } else if (val.type() == typeid(double)) {
-            set(name, std::any_cast<double>(val));
+        if (auto const* m = val.get_if<AnyMap>()) {
+            set_sym(name, *m);
+        } else if (auto const* i = val.get_if<int64_t>()) {
+            set(name, *i);
+        } else if (auto n = val.get_number()) {
+            set(name, *n);
         } else {
-            auto s = std::string(name);
+            auto a = atom(name);
             /* if (accessed.count(s) > 0) { */
             /*     throw sym_error( */
             /*         fmt::format("Can not redefine generic any type {} ({})",
              * s, */
             /*                     val.type().name())); */
             /* } */
-            if (trace && undefined.find(s) != undefined.end()) {
-                fmt::print("Defined {}\n", s);
+            if (trace && undefined.contains(a)) {
+                fmt::print("Defined {}\n", name);
             }
-            syms[s].value = val;
+            auto& value = slot(a);
+            touch(value, val);
+            value = val;
         }
     }
 
     template <typename T>
     void set(std::string_view name, T const& val)
     {
-        auto s = std::string(name);
         if constexpr (std::is_same_v<T, AnyMap>) {
-            set_sym(s, static_cast<AnyMap>(val));
-            return;
+            set_sym(name, static_cast<AnyMap>(val));
         } else {
+            set(atom(name), val);
+        }
+    }
+
+    template <typename T>
+    void set(Atom a, T const& val)
+    {
+        static_assert(!std::is_same_v<T, AnyMap>);
+        // Integers, like label addresses, that keep their value need
+        // no further checks
+        if constexpr (std::is_same_v<T, int64_t>) {
+            if (defined.contains(a)) {
+                auto const* old = values[a].get_if<int64_t>();
+                if (old != nullptr && *old == val) {
+                    return;
+                }
+            }
+        }
+        auto const& name = name_of(a);
 //            auto it = syms.find(std::string(name));
 //            if (it != syms.end()) {
 //                if (it->second.defined) {
@@ -142,83 +314,115 @@ struct SymbolTable
 //                    }
 //                }
 //            }
-            if (accessed.count(s) > 0) {
-                LOGD("%s has been accessed", s);
-                auto it = syms.find(s);
-                if (it != syms.end()) {
-                    if (std::any_cast<T>(it->second.value) != val) {
-                        if (trace) {
-                            if constexpr (std::is_arithmetic_v<T>) {
-                                fmt::print(
-                                    "Redefined {} from {} "
-                                    "to {}\n",
-                                    s, std::any_cast<double>(it->second.value),
-                                    val);
-                            } else {
-                                fmt::print("Redefined {} \n", s);
-                            }
-                        }
-                        undefined.insert(s);
-                    }
+        if (accessed.contains(a)) {
+            LOGD("%s has been accessed", name);
+            if (defined.contains(a)) {
+                auto const& old = values[a];
+                bool changed = false;
+                if constexpr (std::is_arithmetic_v<T>) {
+                    changed = value_cast<Number>(old) !=
+                              static_cast<Number>(val);
+                } else if constexpr (detail::Buffered<T>::value) {
+                    using B = Buffer<typename T::value_type>;
+                    auto const& buf = value_cast<B>(old);
+                    changed = !std::equal(buf.begin(), buf.end(),
+                                          val.begin(), val.end());
                 } else {
+                    changed = value_cast<T>(old) != val;
+                }
+                if (changed) {
                     if (trace) {
-                        fmt::print("Defined {}\n", s);
+                        if constexpr (std::is_arithmetic_v<T>) {
+                            fmt::print(
+                                "Redefined {} from {} "
+                                "to {}\n",
+                                name, value_cast<Number>(old), val);
+                        } else {
+                            fmt::print("Redefined {} \n", name);
+                        }
                     }
+                    record(a);
+                    undefined.insert(a);
+                }
+            } else {
+                if (trace) {
+                    fmt::print("Defined {}\n", name);
                 }
             }
+        }
 
-            if constexpr (std::is_arithmetic_v<T>) {
-                syms[s].value = std::any((double)val);
-            } else {
-                syms[s].value = std::any(val);
+        auto& value = slot(a);
+        Value next(val);
+        touch(value, next);
+        value = std::move(next);
+    }
+
+    // Set `name` to a copy of `data`, unless it already holds the same
+    // bytes. Then its buffer, which other symbols may share, is kept.
+    void set_bytes(std::string_view name, std::vector<uint8_t> const& data)
+    {
+        auto a = atom(name);
+        if (defined.contains(a)) {
+            auto const* old = values[a].get_if<Bytes>();
+            if (old != nullptr && std::equal(old->begin(), old->end(),
+                                             data.begin(), data.end())) {
+                return;
             }
         }
+        set(name, data);
     }
 
-    void set_final(std::string_view name)
+    void set_final(Atom a)
     {
-        std::string s {name};
-        syms[s].final = true;
+        slot(a);
+        finals.insert(a);
     }
 
+    void set_final(std::string_view name) { set_final(atom(name)); }
+
     // Return a map containing all symbols beginning with
-    // name.
+    // name and a dot.
     AnyMap collect(std::string_view name) const
     {
         AnyMap s;
-        for (auto const& p : syms) {
-            auto dot = p.first.find('.');
-            if (dot != std::string::npos) {
-                auto prefix = p.first.substr(0, dot);
-                if (prefix == name) {
-                    // rest = one.x
-                    auto rest = p.first.substr(dot + 1);
-                    // Can never be undefined
-                    s[rest] = syms.at(p.first).value;
-                }
+        atoms->forEachMember(find(name), [&](Atom a) {
+            if (defined.contains(a)) {
+                // rest = one.x
+                auto rest = name_of(a).substr(name.size() + 1);
+                // Can never be undefined
+                s[rest] = values[a];
             }
-        }
+        });
         return s;
     }
 
-    template <typename T = std::any>
-    T& get(std::string_view name)
+    // Numbers are returned by value, since they may be stored as integers
+    template <typename T = Value>
+    std::conditional_t<std::is_same_v<T, Number>, Number, T&>
+    get(std::string_view name)
     {
-        static std::any temp;
+        return get<T>(atom(name));
+    }
+
+    template <typename T = Value>
+    std::conditional_t<std::is_same_v<T, Number>, Number, T&> get(Atom a)
+    {
+        static Value temp;
         static T empty;
-        static std::any zero(0.0);
+        static Value zero(0.0);
         static AnyMap cres;
-        accessed.insert(std::string(name));
+        if (!accessed.contains(a)) {
+            record(a);
+            accessed.insert(a);
+        }
         if constexpr (std::is_same_v<T, AnyMap>) {
-            auto s = std::string(name);
-            cres = collect(s);
+            cres = collect(name_of(a));
             return cres;
         }
-        auto s = std::string(name);
-        auto it = syms.find(s);
-        if (it == syms.end()) {
+        if (!defined.contains(a)) {
+            auto const& name = name_of(a);
 
-            if constexpr (std::is_same_v<T, std::any>) {
+            if constexpr (std::is_same_v<T, Value>) {
                 auto m = collect(name);
                 if (!m.empty()) {
                     // TODO: Can cause problems if reference is kept
@@ -228,26 +432,34 @@ struct SymbolTable
             }
 
             if (!undef_ok) {
-                throw sym_error("Undefined symbol '" + std::string(name) + "'");
+                throw sym_error("Undefined symbol '" + name + "'");
             }
             LOGD("%s is undefined", name);
             if (trace) {
                 fmt::print("Access undefined '{}'\n", name);
             }
-            undefined.insert(s);
-            if constexpr (std::is_same_v<T, std::any>) {
+            record(a);
+            undefined.insert(a);
+            if constexpr (std::is_same_v<T, Value>) {
                 return zero;
             }
             LOGD("Returning default (%s)", typeid(T{}).name());
             return empty;
         }
-        if (it->second.value.type() == typeid(AnyMap)) {
-            LOGE("MAP %s in table!!", name);
+        auto& value = values[a];
+        if (value.is<AnyMap>()) {
+            LOGE("MAP %s in table!!", name_of(a));
         }
-        if constexpr (std::is_same_v<T, std::any>) {
-            return it->second.value;
+        if constexpr (std::is_same_v<T, Value>) {
+            return value;
+        } else if constexpr (std::is_same_v<T, Number>) {
+            return value_cast<Number>(value);
+        } else {
+            if (auto* p = value.get_if<T>()) {
+                return *p;
+            }
+            throw bad_value_cast();
         }
-        return *std::any_cast<T>(&it->second.value);
     }
 
     template <typename T>
@@ -275,77 +487,212 @@ struct SymbolTable
         return Accessor<T>(*this, name);
     }
 
-    Accessor<std::any> operator[](std::string_view name)
+    Accessor<Value> operator[](std::string_view name)
     {
-        return Accessor<std::any>(*this, name);
+        return Accessor<Value>(*this, name);
     }
 
     template <typename FN>
     void forAll(FN const& fn) const
     {
-        for (auto const& p : syms) {
-            fn(p.first, p.second.value);
-        }
+        defined.forEach([&](Atom a) { fn(name_of(a), values[a]); });
     }
 
     // Remove all undefined that now exists
     void resolve()
     {
-        for (auto const& [name, val] : syms) {
-            undefined.erase(name);
-        }
+        defined.forEach([&](Atom a) {
+            if (undefined.contains(a)) {
+                record(a);
+                undefined.erase(a);
+            }
+        });
     }
 
     bool ok() const
     {
-        return std::none_of(
-            undefined.begin(), undefined.end(),
-            [&](auto const& u) { return syms.find(u) == syms.end(); });
+        bool missing = false;
+        undefined.forEach(
+            [&](Atom a) { missing |= !defined.contains(a); });
+        return !missing;
+    }
+
+    void erase(Atom a)
+    {
+        record(a);
+        if (defined.contains(a)) {
+            touch(values[a], {});
+            values[a] = Value{};
+            finals.erase(a);
+            defined.erase(a);
+        }
+        accessed.erase(a);
     }
 
     void erase(std::string_view name)
     {
-        syms.erase(std::string(name));
-        accessed.erase(std::string(name));
+        if (auto a = find(name); a != NoAtom) {
+            erase(a);
+        }
     }
 
+    // Erase `name` and all symbols in its namespace
     void erase_all(std::string_view name)
     {
-        {
-            auto it = syms.begin();
-            while (it != syms.end()) {
-                if (utils::startsWith(it->first, name)) {
-                    it = syms.erase(it);
-                } else {
-                    it++;
-                }
-            }
+        auto a = find(name);
+        if (a == NoAtom) {
+            return;
         }
-        {
-            auto it = accessed.begin();
-            while (it != accessed.end()) {
-                if (utils::startsWith(*it, name)) {
-                    it = accessed.erase(it);
-                } else {
-                    it++;
-                }
+        erase(a);
+        atoms->forEachMember(a, [&](Atom m) { erase(m); });
+    }
+
+    // Remove all symbols with values matching the predicate
+    template <typename FN>
+    void erase_if(FN const& fn)
+    {
+        defined.forEach([&](Atom a) {
+            if (fn(values[a])) {
+                erase(a);
             }
-        }
+        });
     }
 
     bool done() const { return undefined.empty(); }
 
-    std::unordered_set<std::string> const& get_undefined() const
+    void touch() { version = ++versions; }
+
+    // Storing a lambda again, as each pass does, keeps the version
+    void touch(Value const& from, Value const& to)
+    {
+        if ((from.is<Macro>() || to.is<Macro>()) &&
+            from.get_if<Macro>() != to.get_if<Macro>()) {
+            touch();
+        }
+    }
+
+    AtomSet const& get_undefined() const
     {
         return undefined;
     }
 
     void clear()
     {
-        for (auto& s : syms) {
-            s.second.final = false;
+        if (journaling > 0) {
+            defined.forEach([&](Atom a) { record(a); });
+            accessed.forEach([&](Atom a) { record(a); });
+            undefined.forEach([&](Atom a) { record(a); });
         }
+        finals.clear();
+        accessed.clear();
+        undefined.clear();
+    }
+
+    // Start over with atoms for the defined symbols only, so names that
+    // are gone no longer take up space
+    void reset_atoms()
+    {
+        assert(journaling == 0);
+        auto const old = atoms;
+        auto oldValues = std::move(values);
+        auto const oldDefined = defined;
+        auto const oldFinals = finals;
+        atoms = std::make_shared<Atoms>();
+        values.clear();
+        defined.clear();
+        finals.clear();
         accessed.clear();
         undefined.clear();
+        oldDefined.forEach([&](Atom a) {
+            auto n = atom(old->name(a));
+            slot(n) = std::move(oldValues[a]);
+            if (oldFinals.contains(a)) {
+                finals.insert(n);
+            }
+        });
+        touch();
+    }
+
+    // Undoes all changes made to the table during its lifetime, in time
+    // proportional to the number of changes
+    class Rollback
+    {
+    public:
+        explicit Rollback(SymbolTable& st_)
+            : st(st_), mark(st.journal.size()), version(st.version)
+        {
+            st.journaling++;
+        }
+        ~Rollback()
+        {
+            while (st.journal.size() > mark) {
+                st.undo(st.journal.back());
+                st.journal.pop_back();
+            }
+            st.journaling--;
+            if (st.version != version) {
+                st.touch();
+            }
+        }
+        Rollback(Rollback const&) = delete;
+        Rollback& operator=(Rollback const&) = delete;
+
+    private:
+        SymbolTable& st;
+        size_t mark;
+        uint64_t version;
+    };
+
+private:
+    // The value of `a`, created if missing
+    Value& slot(Atom a)
+    {
+        record(a);
+        if (a >= values.size()) {
+            values.resize(atoms->size());
+        }
+        defined.insert(a);
+        return values[a];
+    }
+
+    // The state of a symbol before a change
+    struct Change
+    {
+        Atom atom;
+        Value value;
+        bool defined;
+        bool final;
+        bool accessed;
+        bool undefined;
+    };
+    std::vector<Change> journal;
+    int journaling = 0;
+
+    void record(Atom a)
+    {
+        if (journaling > 0) {
+            journal.push_back({a, a < values.size() ? values[a] : Value{},
+                               defined.contains(a), finals.contains(a),
+                               accessed.contains(a), undefined.contains(a)});
+        }
+    }
+
+    void undo(Change const& change)
+    {
+        auto a = change.atom;
+        if (a >= values.size()) {
+            values.resize(atoms->size());
+        }
+        values[a] = change.value;
+        for (auto [set, on] : {std::pair{&defined, change.defined},
+                               std::pair{&finals, change.final},
+                               std::pair{&accessed, change.accessed},
+                               std::pair{&undefined, change.undefined}}) {
+            if (on) {
+                set->insert(a);
+            } else {
+                set->erase(a);
+            }
+        }
     }
 };
@@ -6,6 +6,7 @@
 #include <string>
 
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
 /*
  * Any type should be settable
@@ -33,15 +34,14 @@ using namespace std::string_literals;
 TEST_CASE("symbol_table.basic")
 {
     SymbolTable st;
-    using std::any_cast;
 
     st.set("a", 3);
 
-    int res = st.get<int>("a");
+    Number res = st.get<Number>("a");
     REQUIRE(res == 3);
 
     REQUIRE(st.undefined.empty());
-    REQUIRE(st.get<float>("not_here") == 0.0);
+    REQUIRE(st.get<Number>("not_here") == 0.0);
     REQUIRE(!st.undefined.empty());
 
     //REQUIRE(st.is_constant("not_here"));
@@ -50,28 +50,42 @@ TEST_CASE("symbol_table.basic")
     s["x"] = 3;
     s["y"] = 2;
     st.set("pos", s);
-    REQUIRE(st.get<int>("pos.x") == 3);
-    REQUIRE(st.get<int>("pos.y") == 2);
+    REQUIRE(st.get<Number>("pos.x") == 3);
+    REQUIRE(st.get<Number>("pos.y") == 2);
 
     st.set("struct.x", 10);
     st.set("struct.y", 20);
 
     auto syms = st.get<AnyMap>("struct");
-    REQUIRE(any_cast<int>(syms["x"]) == 10);
-    REQUIRE(any_cast<int>(syms["y"]) == 20);
+    REQUIRE(value_cast<Number>(syms["x"]) == 10);
+    REQUIRE(value_cast<Number>(syms["y"]) == 20);
 
     AnyMap deep;
-    deep["one"] = std::any(s);
-    deep["two"] = std::any(syms);
+    deep["one"] = Value(s);
+    deep["two"] = Value(syms);
 
     st.set("deep", deep);
 
     st.forAll([](auto const& s, auto const& v) { LOGI("%s", s); });
 
-    REQUIRE(st.at<int>("deep.two.x") == 10);
-    REQUIRE(st.get<int>("deep.one.y") == 2);
+    REQUIRE(st.at<Number>("deep.two.x") == 10);
+    auto atom = st.atom("deep.two.x");
+    REQUIRE(atom == st.atom("deep.two.x"));
+    REQUIRE(st.get<Number>(atom) == 10);
+    REQUIRE(st.is_defined(atom));
 
-    REQUIRE_THROWS(st.set("a", "hey"s));
+    auto two = st.get<AnyMap>("deep.two");
+    REQUIRE(two.size() == 2);
+    REQUIRE(value_cast<Number>(two["x"]) == 10);
+    REQUIRE(st.get<AnyMap>("deep").size() == 4);
+
+    st.set("structure", 1);
+    st.erase_all("struct");
+    REQUIRE(st.get<AnyMap>("struct").empty());
+    REQUIRE(st.get_sym("structure"));
+    REQUIRE(st.get<Number>("deep.one.y") == 2);
+
+    REQUIRE_THROWS(st.set("a", "hey"sv));
 
     //REQUIRE_THROWS(st.set("deep.two", syms));
 
@@ -81,7 +95,7 @@ TEST_CASE("symbol_table.basic")
     st.set("a", 9);
     REQUIRE(st.undefined.size() == 2);
 
-    st.at<int>("not_here") = 5;
+    st.at<Number>("not_here") = 5;
 
     REQUIRE(st.ok());
     REQUIRE(!st.done());
@@ -89,9 +103,73 @@ TEST_CASE("symbol_table.basic")
     st.clear();
 
     st.set("b", 4);
-    st.set("c", "hey"s);
+    st.set("c", "hey"sv);
 
-    REQUIRE(st.get<std::string>("c") == "hey");
+    REQUIRE(st.get<std::string_view>("c") == "hey");
 
     REQUIRE(st.done());
 }
+
+TEST_CASE("symbol_table.rollback")
+{
+    SymbolTable st;
+    st.set("a", 1);
+    st.set("b", 2);
+    {
+        SymbolTable::Rollback const rollback{st};
+        st.set("a", 3);
+        st.erase("b");
+        st.set("c", 4);
+        REQUIRE(st.get<Number>("missing") == 0);
+        REQUIRE(st.get<Number>("a") == 3);
+    }
+    REQUIRE(st.get<Number>("a") == 1);
+    REQUIRE(st.get<Number>("b") == 2);
+    REQUIRE(!st.get_sym("c"));
+    REQUIRE(st.done());
+
+    // Labels are final until the next pass
+    auto label = st.atom("label");
+    st.set(label, int64_t{0x801});
+    st.set_final(label);
+    REQUIRE(!st.is_redefinable(label));
+    {
+        SymbolTable::Rollback const rollback{st};
+        st.erase(label);
+        REQUIRE(st.is_redefinable(label));
+    }
+    REQUIRE(!st.is_redefinable(label));
+    REQUIRE(st.get_sym("label")->final);
+    st.clear();
+    REQUIRE(st.is_redefinable(label));
+    REQUIRE(st.get<Number>(label) == 0x801);
+}
+
+TEST_CASE("symbol_table.atoms")
+{
+    SymbolTable st;
+    st.set("a.x", 1);
+    st.set("b", 2);
+    REQUIRE(st.get<Number>("missing") == 0);
+
+    // Lookups do not intern names
+    auto const count = st.atoms->size();
+    REQUIRE(!st.is_defined("nope"));
+    REQUIRE(!st.get_sym("nope.x"));
+    REQUIRE(st.is_redefinable("nope"));
+    st.erase("nope");
+    st.erase_all("nope");
+    REQUIRE(st.collect("nope").empty());
+    REQUIRE(st.atoms->size() == count);
+
+    // Only the atoms of defined symbols are kept
+    auto copy = st;
+    st.set_final("b");
+    st.reset_atoms();
+    REQUIRE(st.atoms->size() == 3);
+    REQUIRE(st.atoms->find("missing") == NoAtom);
+    REQUIRE(st.get<Number>("a.x") == 1);
+    REQUIRE(value_cast<Number>(st.get<AnyMap>("a")["x"]) == 1);
+    REQUIRE(!st.is_redefinable("b"));
+    REQUIRE(copy.get<Number>("b") == 2);
+}
@@ -0,0 +1,376 @@
+#pragma once
+
+#include "6502.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using Number = double;
+
+class Value;
+
+// Maps from symbol names to values; used for structs like images and
+// test results
+using AnyMap = std::unordered_map<std::string, Value>;
+
+// Defined by the assembler
+struct Block;
+struct Call;
+struct Def;
+struct Macro;
+struct Meta;
+struct Ternary;
+
+struct Instruction
+{
+    Instruction(std::string_view op, sixfive::Mode m, double v)
+        : opcode(op), mode(m), val(static_cast<int32_t>(v))
+    {}
+    std::string_view opcode;
+    sixfive::Mode mode;
+    int32_t val;
+};
+
+// Binary operators. The `Operator` token of an expression is resolved
+// to one of these when its AST node is first evaluated.
+enum class Operator : uint8_t
+{
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    IDiv,
+    Shl,
+    Shr,
+    And,
+    Or,
+    Xor,
+    LogAnd,
+    LogOr,
+    Eq,
+    Ne,
+    Lt,
+    Gt,
+    Le,
+    Ge,
+    Join,
+    Count
+};
+
+// An immutable array shared by all its copies, or a part of one. Copies
+// and slices never copy the elements.
+template <typename T>
+class Buffer
+{
+    std::shared_ptr<std::vector<T>> elements;
+    size_t offset = 0;
+    size_t length = 0;
+
+public:
+    using value_type = T;
+
+    Buffer() = default;
+    Buffer(std::vector<T> v) // NOLINT
+        : elements(std::make_shared<std::vector<T>>(std::move(v))),
+          length(elements->size())
+    {}
+
+    T const* data() const
+    {
+        return elements ? elements->data() + offset : nullptr;
+    }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    T const* begin() const { return data(); }
+    T const* end() const { return data() + length; }
+    T const& operator[](size_t i) const { return data()[i]; }
+
+    // Elements [a, b) of this buffer
+    Buffer slice(size_t a, size_t b) const
+    {
+        Buffer res = *this;
+        res.offset = offset + a;
+        res.length = b - a;
+        return res;
+    }
+
+    std::vector<T> vector() const { return {begin(), end()}; }
+
+    // Change the elements with `fn`. They are copied first, unless this
+    // buffer is the only one that refers to them.
+    template <typename FN>
+    void edit(FN const& fn)
+    {
+        if (!elements || elements.use_count() > 1 || offset != 0 ||
+            length != elements->size()) {
+            elements = std::make_shared<std::vector<T>>(vector());
+            offset = 0;
+        }
+        fn(*elements);
+        length = elements->size();
+    }
+
+    bool operator==(Buffer const& other) const
+    {
+        return std::equal(begin(), end(), other.begin(), other.end());
+    }
+    bool operator!=(Buffer const& other) const { return !(*this == other); }
+};
+
+using Bytes = Buffer<uint8_t>;
+using Numbers = Buffer<Number>;
+
+class bad_value_cast : public std::bad_cast
+{
+public:
+    const char* what() const noexcept override { return "Data type error"; }
+};
+
+namespace detail {
+
+// Types that are rare or large are kept on the heap, and shared when
+// the value is copied
+template <typename T>
+struct Boxed : std::false_type
+{};
+template <>
+struct Boxed<AnyMap> : std::true_type
+{};
+template <>
+struct Boxed<std::vector<Value>> : std::true_type
+{};
+template <>
+struct Boxed<std::pair<std::string_view, Value>> : std::true_type
+{};
+template <>
+struct Boxed<Ternary> : std::true_type
+{};
+template <>
+struct Boxed<Block> : std::true_type
+{};
+template <>
+struct Boxed<Call> : std::true_type
+{};
+template <>
+struct Boxed<Def> : std::true_type
+{};
+template <>
+struct Boxed<Macro> : std::true_type
+{};
+template <>
+struct Boxed<Meta> : std::true_type
+{};
+
+// Vectors that are stored as buffers
+template <typename T>
+struct Buffered : std::false_type
+{};
+template <>
+struct Buffered<std::vector<uint8_t>> : std::true_type
+{};
+template <>
+struct Buffered<std::vector<Number>> : std::true_type
+{};
+
+template <typename T>
+using Stored = std::conditional_t<Boxed<T>::value, std::shared_ptr<T>, T>;
+
+} // namespace detail
+
+// The result of evaluating an AST node, and the value of a symbol.
+// Numbers, strings, instructions and small pairs are stored inline, so
+// arithmetic never allocates. Whole numbers are stored as exact
+// `int64_t`s and other arithmetic types as `Number`; both are read as
+// `Number`. Byte and number vectors are stored as `Bytes` and `Numbers`.
+class Value
+{
+    using Storage = std::variant<
+        std::monostate, Number, int64_t, std::string_view, char, Instruction,
+        Operator,
+        Bytes, Numbers, std::vector<std::string_view>,
+        std::pair<std::string_view, int32_t>,
+        std::pair<std::string_view, Number>,
+        std::pair<std::string_view, std::string_view>,
+        detail::Stored<AnyMap>, detail::Stored<std::vector<Value>>,
+        detail::Stored<std::pair<std::string_view, Value>>,
+        detail::Stored<Ternary>, detail::Stored<Block>,
+        detail::Stored<Call>, detail::Stored<Def>, detail::Stored<Macro>,
+        detail::Stored<Meta>>;
+
+    Storage data;
+
+public:
+    Value() = default;
+
+    template <typename T, typename D = std::decay_t<T>,
+              typename = std::enable_if_t<!std::is_same_v<D, Value>>>
+    Value(T&& v) // NOLINT
+    {
+        if constexpr (std::is_integral_v<D> && !std::is_same_v<D, char>) {
+            data.template emplace<int64_t>(static_cast<int64_t>(v));
+        } else if constexpr (std::is_floating_point_v<D>) {
+            set_number(static_cast<Number>(v));
+        } else if constexpr (detail::Buffered<D>::value) {
+            data.template emplace<Buffer<typename D::value_type>>(
+                std::forward<T>(v));
+        } else if constexpr (detail::Boxed<D>::value) {
+            data.template emplace<detail::Stored<D>>(
+                std::make_shared<D>(std::forward<T>(v)));
+        } else {
+            data.template emplace<D>(std::forward<T>(v));
+        }
+    }
+
+    bool has_value() const { return data.index() != 0; }
+
+    // Name of the held type, for tracing
+    std::string_view type_name() const
+    {
+        static constexpr std::string_view names[] = {
+            "none",        "number",       "integer",     "string",
+            "char",        "instruction",  "operator",    "bytes",
+            "numbers",     "strings",      "indexed name", "enum value",
+            "opcode",      "map",          "values",      "named value",
+            "ternary",     "block",        "call",        "definition",
+            "macro",       "meta"};
+        static_assert(std::size(names) == std::variant_size_v<Storage>);
+        return names[data.index()];
+    }
+
+    template <typename T>
+    bool is() const
+    {
+        if constexpr (std::is_same_v<T, Number>) {
+            return std::holds_alternative<int64_t>(data) ||
+                   std::holds_alternative<Number>(data);
+        } else {
+            return std::holds_alternative<detail::Stored<T>>(data);
+        }
+    }
+
+    // Numbers are read by value, since they may be stored as integers
+    std::optional<Number> get_number() const
+    {
+        if (auto const* i = std::get_if<int64_t>(std::addressof(data))) {
+            return static_cast<Number>(*i);
+        }
+        if (auto const* n = std::get_if<Number>(std::addressof(data))) {
+            return *n;
+        }
+        return std::nullopt;
+    }
+
+    template <typename T>
+    T const* get_if() const
+    {
+        static_assert(!std::is_same_v<T, Number>, "Use get_number()");
+        auto const* p = std::get_if<detail::Stored<T>>(std::addressof(data));
+        if constexpr (detail::Boxed<T>::value) {
+            return p != nullptr ? p->get() : nullptr;
+        } else {
+            return p;
+        }
+    }
+
+    // Shared values are copied before they can be modified
+    template <typename T>
+    T* get_if()
+    {
+        static_assert(!std::is_same_v<T, Number>, "Use get_number()");
+        auto* p = std::get_if<detail::Stored<T>>(std::addressof(data));
+        if constexpr (detail::Boxed<T>::value) {
+            if (p == nullptr) {
+                return nullptr;
+            }
+            if (p->use_count() > 1) {
+                *p = std::make_shared<T>(**p);
+            }
+            return p->get();
+        } else {
+            return p;
+        }
+    }
+
+private:
+    // Numbers without a fraction that fit are kept as integers, so
+    // they stay exact in integer arithmetic
+    void set_number(Number n)
+    {
+        constexpr Number limit = 9223372036854775808.0; // 2^63
+        if (n >= -limit && n < limit) {
+            auto i = static_cast<int64_t>(n);
+            if (static_cast<Number>(i) == n) {
+                data.template emplace<int64_t>(i);
+                return;
+            }
+        }
+        data.template emplace<Number>(n);
+    }
+};
+
+// Like std::any_cast; the pointer versions return nullptr and the
+// others throw bad_value_cast if the value holds another type.
+// A `Number` is returned by value, and as an optional instead of a
+// pointer.
+template <typename T>
+auto value_cast(Value const* v)
+{
+    if constexpr (std::is_same_v<T, Number>) {
+        return v->get_number();
+    } else {
+        return v->get_if<T>();
+    }
+}
+
+template <typename T>
+auto value_cast(Value* v)
+{
+    if constexpr (std::is_same_v<T, Number>) {
+        return v->get_number();
+    } else {
+        return v->get_if<T>();
+    }
+}
+
+template <typename T>
+std::conditional_t<std::is_same_v<T, Number>, Number, T const&>
+value_cast(Value const& v)
+{
+    if constexpr (std::is_same_v<T, Number>) {
+        if (auto n = v.get_number()) {
+            return *n;
+        }
+    } else {
+        if (auto const* p = v.get_if<T>()) {
+            return *p;
+        }
+    }
+    throw bad_value_cast();
+}
+
+template <typename T>
+T value_cast(Value&& v)
+{
+    if constexpr (std::is_same_v<T, Number>) {
+        if (auto n = v.get_number()) {
+            return *n;
+        }
+    } else {
+        if (auto* p = v.get_if<T>()) {
+            return std::move(*p);
+        }
+    }
+    throw bad_value_cast();
+}
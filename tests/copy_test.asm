@@ -1,14 +1,18 @@
 
     !section "main", $800
+peek = [ adr -> RAM[adr] ]
+
 !test "my_test"
 start:
     ldx #0
 .loop
+    !check X < 12
     lda $1000,x
     sta $2000,x
     inx
     cpx #12
     bne .loop
+    !check peek($2006) == 7 && RAM[$2000] == 1
     rts
     !section "data", $1000
     !byte 1,2,3,4,5,6,7
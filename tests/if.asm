@@ -9,6 +9,12 @@
         Y = 3
     }
 
+    ; Arguments are defined inside their block
+    !rept 3 {
+        !ifdef i { !assert i < 3 } else { !assert 0 }
+        !ifndef i { !assert 0 }
+    }
+
     !test X=9, "hey"
 hey:
     clc
@@ -4,4 +4,28 @@ mysin = [ x, amp, size ->
 sin:
     !fill 100 { mysin(i, 255, 100) } 
     
-    !assert mysin(0, 100, 100) == 50
\ No newline at end of file
+    !assert mysin(0, 100, 100) == 50
+    ; Calls see a lambda that is redefined
+    !rept 2 {
+        !if i == 0 {
+            f = [ x -> x + 1 ]
+        } else {
+            f = [ x -> x * 3 ]
+        }
+        !assert f(10) == (i == 0 ? 11 : 30)
+    }
+    f = [ x -> x * 2 ]
+    !assert f(10) == 20
+
+    ; Arguments hide symbols without changing them
+    x = 5
+    g = [ x -> x * 2 ]
+    !assert g(3) == 6 && x == 5
+    twice = [ fn, v -> fn(fn(v)) ]
+    !assert twice(g, 3) == 12
+    !rept 3 { !assert g(i) == i * 2 }
+
+    ; Only lambdas that depend on nothing but their arguments are
+    ; memoized
+    k = [ x -> x + i ]
+    !rept 3 { !assert k(1) == 1 + i && g(1) == 2 }
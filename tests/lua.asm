@@ -9,3 +9,18 @@
 
     !assert lua_test(1) == 4
 
+
+%{
+    function emit_nops(n)
+        for i = 1, n do
+            assemble("nop")
+        end
+    end
+}%
+
+nops:
+%{
+    emit_nops(3)
+}%
+nops_end:
+    !assert nops_end - nops == 3
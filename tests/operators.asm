@@ -34,3 +34,23 @@
     !assert %110 + %1001 == %1111
 
 
+
+    !assert 7 \ 2 == 3
+    !assert 1 << 4 == $10
+    !assert $f0 >> 4 == $f
+    !assert ($f0 & $3c) == $30
+    !assert ($f0 | $0f) == $ff
+    !assert ($ff ^ $0f) == $f0
+    !assert (1 && 0) == 0
+    !assert (1 || 0) == 1
+    !assert 3 <= 3 && 3 >= 3 && 2 < 3 && 3 > 2 && 2 != 3
+    !assert "ab" + "c" == "abc"
+    !assert "ab" != "abc"
+
+    ; Whole numbers stay exact above 2^53
+    big = 1 << 60
+    !assert big + 1 - big == 1
+    !assert (big | 1) & 1 == 1
+    !assert 7 / 2 == 3.5 && 6 / 3 == 2
+    lo = <(big + $1234)
+    !assert lo == $34 && -big + big == 0
@@ -31,3 +31,11 @@ $
     dex
     bne -
     rts
+
+    ; Slices of slices refer to the right elements
+    bytes = load("../data/test.sid")
+    head = bytes[2:10]
+    part = head[3:6]
+    !assert len(part) == 3
+    !assert part[0] == bytes[5] && part[2] == bytes[7]
+    !assert compare(part, bytes[5:8])
@@ -0,0 +1,55 @@
+    !org $1000
+
+sine:
+    !table 256, [ i -> (sin(i * Math.Pi * 2 / 256) + 1) * 100 + 24 ]
+sine_rept:
+    !rept 256 { !byte (sin(i * Math.Pi * 2 / 256) + 1) * 100 + 24 }
+
+squares_lo:
+    !table 256, [ x -> x * x / 4 ], "lo"
+squares_hi:
+    !table 256, [ x -> x * x / 4 ], "hi"
+squares:
+    !table 256, [ x -> x * x / 4 ], "words"
+doubled:
+    !table [1,2,3] * 2, [ v -> clamp(v * 2, 0, 5) ]
+doubled_end:
+    ; Labels that are not known yet may divide by zero in early passes
+scaled:
+    !table 3, [ x -> x * 8 / (gap_end - gap) ]
+gap:
+    !byte 0, 0
+gap_end:
+
+    ; Lambdas that are not plain arithmetic are called for each value
+    values = table(4, [ i -> i == 2 ? 7 : i ])
+    !assert values[2] == 7 && values[3] == 3
+    !assert table(3, [ i -> -i ]) == [0, -1, -2]
+
+    !assert squares - squares_hi == 256
+    !assert doubled_end - doubled == 6
+
+    !test "table"
+    ldx #0
+$   lda sine,x
+    cmp sine_rept,x
+    bne .fail
+    inx
+    bne -
+    ldx #200
+    lda squares_lo,x
+    ldy squares_hi,x
+    !check A == (10000 & $ff) && Y == (10000 >> 8)
+    lda squares+2*200
+    ldy squares+2*200+1
+    !check A == (10000 & $ff) && Y == (10000 >> 8)
+    lda doubled+2
+    !check A == 5
+    lda doubled+3
+    !check A == 2
+    lda scaled+2
+    !check A == 8
+    rts
+.fail
+    !check X == $100
+    rts